@@ -9,6 +9,68 @@
 #endif
 #include <ESP8266FastROMFS.h>
 
+#if FASTROMFS_TRACE && !defined(ARDUINO)
+// Capture the whole run for tools/fsreplay
+static void TraceToFile(const FastROMFSTraceRecord *rec, void *arg)
+{
+  fwrite(rec, sizeof(*rec), 1, (FILE *)arg);
+}
+#endif
+
+static void CountYield(void *arg)
+{
+  (*(int *)arg)++;
+}
+
+// Bytes are i % 251, except "XXXX" at xAt.  Returns how many differ or are missing.
+static int CheckPattern(FastROMFilesystem *fs, const char *name, int len, int xAt)
+{
+  FastROMFile *f = fs->open(name, "r");
+  if (!f) return len + 1;
+  int bad = (f->size() != len) ? 1 : 0;
+  uint8_t b[256];
+  for (int off = 0; off < len; off += sizeof(b)) {
+    int n = f->read(b, sizeof(b));
+    for (int i = 0; i < n; i++) {
+      int at = off + i;
+      uint8_t want = ((at >= xAt) && (at < xAt + 4)) ? 'X' : at % 251;
+      if (b[i] != want) bad++;
+    }
+    if (n <= 0) break;
+  }
+  f->close();
+  return bad;
+}
+
+#ifndef ARDUINO
+// In-memory stand-in for a socket.  Each write keeps it "busy" for a few availableForWrite() polls, like a TCP window
+// waiting on an ACK, and it can drop the connection after a given number of bytes.
+class MemSink : public FastROMFSSink
+{
+  public:
+    MemSink(uint8_t *buf, int cap, int busyPolls, int dropAt) : data(buf), len(0), cap(cap), busyPolls(busyPolls), busy(0), dropAt(dropAt) {}
+    size_t write(const uint8_t *buf, size_t size) override {
+      int n = (int)size;
+      if (n > dropAt - len) n = dropAt - len;
+      if (n > cap - len) n = cap - len;
+      if (n <= 0) return 0;
+      memcpy(data + len, buf, n);
+      len += n;
+      busy = busyPolls;
+      return n;
+    }
+    int availableForWrite() override {
+      if (busy) {
+        busy--;
+        return 0;
+      }
+      return 1460;
+    }
+    uint8_t *data;
+    int len, cap, busyPolls, busy, dropAt;
+};
+#endif
+
 #ifdef ARDUINO
 #define DEBUG_FASTROMFS Serial.printf
 void RunFSTest()
@@ -23,6 +85,13 @@ int main(int argc, char **argv)
   srand(time(NULL));
 #endif
   FastROMFilesystem *fs = new FastROMFilesystem;
+#if FASTROMFS_TRACE && !defined(ARDUINO)
+  FILE *traceFile = fopen("fstest.trace", "wb");
+  if (traceFile) fs->setTraceHook(TraceToFile, traceFile);
+#endif
+#if FASTROMFS_WRITEBEHIND
+  fs->setWriteBehind(true);
+#endif
   fs->mkfs();
   DEBUG_FASTROMFS("mount ret = %d\n", fs->mount());
   DEBUG_FASTROMFS("Bytes Free: %d\n", fs->available());
@@ -190,6 +259,644 @@ int main(int argc, char **argv)
   f->close();
 #endif
 
+  // A reader tailing a file another handle is appending to sees unflushed data
+  FastROMFile *w = fs->open("tail.log", "a");
+  FastROMFile *r = fs->open("tail.log", "r");
+  int tailed = 0, tailErrors = 0;
+  for (int i = 0; i < 1000; i++) {
+    w->write("0123456789", 10);
+    while ((len = r->read(buff, 7)) > 0) {
+      for (int j = 0; j < len; j++, tailed++)
+        if (buff[j] != '0' + (tailed % 10)) tailErrors++;
+    }
+  }
+  DEBUG_FASTROMFS("Tailed %d of %d bytes, %d errors\n", tailed, w->size(), tailErrors);
+  if (tailErrors || (tailed != w->size())) DEBUG_FASTROMFS("ERROR!  Tailing reader out of sync\n");
+  // An r+ rewrite relocates the sector under the reader, which must follow it
+  FastROMFile *u = fs->open("tail.log", "r+");
+  u->seek(5000);
+  u->write("XXXX", 4);
+  r->seek(4990);
+  len = r->read(buff, 20);
+  buff[len] = 0;
+  DEBUG_FASTROMFS("coherent r+ read='%s'\n", buff);
+  if (memcmp(buff + 10, "XXXX", 4)) DEBUG_FASTROMFS("ERROR!  Reader missed r+ update\n");
+  u->close();
+  r->close();
+  w->close();
+
+  // Allocation should come out of the pool idle() erased ahead of time
+  FastROMFSStats st;
+  while (fs->idle(4)) { /* top up */ }
+  fs->resetStats();
+  f = fs->open("preerase.bin", "w");
+  for (int i = 0; i < 3 * 4096 / 10; i++) f->write("0123456789", 10);
+  f->close();
+  fs->getStats(&st);
+  DEBUG_FASTROMFS("Pre-erase hits=%u, misses=%u, erases=%u, pool=%d\n", st.preEraseHits, st.preEraseMisses, st.sectorErases, st.preErasePool);
+  if (!st.preEraseHits) DEBUG_FASTROMFS("ERROR!  Allocation ignored the pre-erased pool\n");
+
+  // Flipping a status byte from 0xff to 0x00 shouldn't move the sector
+  f = fs->open("status.bin", "w");
+  for (int i = 0; i < 100; i++) buff[i] = (i & 1) ? 0xff : 'A';
+  f->write(buff, 100);
+  f->close();
+  fs->resetStats();
+  f = fs->open("status.bin", "r+");
+  f->seek(51);
+  f->write("\0", 1);
+  f->close();
+  fs->getStats(&st);
+  f = fs->open("status.bin", "r");
+  f->read(buff, 100);
+  f->close();
+  DEBUG_FASTROMFS("In-place updates=%u, erases=%u, status[49..53]=%02x %02x %02x %02x %02x\n", st.inPlaceUpdates, st.sectorErases,
+                  (uint8_t)buff[49], (uint8_t)buff[50], (uint8_t)buff[51], (uint8_t)buff[52], (uint8_t)buff[53]);
+  if ((st.inPlaceUpdates != 1) || st.sectorErases || ((uint8_t)buff[51] != 0) || ((uint8_t)buff[53] != 0xff)) DEBUG_FASTROMFS("ERROR!  Bit-clearing update wasn't done in place\n");
+
+  // Byte-at-a-time Stream calls, across sector boundaries and through the unflushed buffer
+  f = fs->open("stream.bin", "w+");
+  for (int i = 0; i < 10000; i++) f->write((uint8_t)(i * 7));
+  f->seek(0);
+  int streamErrors = 0;
+  for (int i = 0; i < 10000; i++) {
+    int p = f->peek();
+    if ((p != (uint8_t)(i * 7)) || (f->read() != p)) streamErrors++;
+  }
+  if (f->read() != -1) streamErrors++;
+  f->seek(4095);
+  f->write((uint8_t)'Z');
+  f->seek(4095);
+  if (f->read() != 'Z') streamErrors++;
+  f->close();
+  DEBUG_FASTROMFS("Stream byte test: %d errors\n", streamErrors);
+  if (streamErrors) DEBUG_FASTROMFS("ERROR!  Stream byte fast path returned wrong data\n");
+
+  // Header + payload + trailer records, gathered on the way out and scattered on the way back
+  f = fs->open("records.bin", "w");
+  for (uint32_t i = 0; i < 300; i++) {
+    uint8_t payload[50];
+    memset(payload, (uint8_t)i, sizeof(payload));
+    uint16_t trailer = 0xa5a5 ^ i;
+    FastROMFSIOVec iov[3] = { { &i, sizeof(i) }, { payload, sizeof(payload) }, { &trailer, sizeof(trailer) } };
+    if (f->writev(iov, 3) != sizeof(i) + sizeof(payload) + sizeof(trailer)) DEBUG_FASTROMFS("ERROR!  Short writev()\n");
+  }
+  f->close();
+  f = fs->open("records.bin", "r");
+  int recordErrors = 0;
+  for (uint32_t i = 0; i < 300; i++) {
+    uint32_t hdr;
+    uint8_t payload[50];
+    uint16_t trailer;
+    FastROMFSIOVec iov[3] = { { &hdr, sizeof(hdr) }, { payload, sizeof(payload) }, { &trailer, sizeof(trailer) } };
+    if ((f->readv(iov, 3) != 56) || (hdr != i) || (payload[0] != (uint8_t)i) || (payload[49] != (uint8_t)i) || (trailer != (0xa5a5 ^ i))) recordErrors++;
+  }
+  if ((f->size() != 300 * 56) || !f->eof()) recordErrors++;
+  f->close();
+  DEBUG_FASTROMFS("Vectored record test: %d errors\n", recordErrors);
+  if (recordErrors) DEBUG_FASTROMFS("ERROR!  readv()/writev() records don't match\n");
+
+  // Running out of pooled handles or write buffers fails the open, and closing gives the slot back
+  {
+    FastROMFile *h[FASTROMFS_MAX_OPEN_FILES + 1];
+    int poolErrors = 0;
+    fs->resetStats();
+    for (int i = 0; i < FASTROMFS_MAX_WRITE_BUFFERS; i++) {
+      char nm[16];
+      sprintf(nm, "pool%d.bin", i);
+      h[i] = fs->open(nm, "w");
+      if (!h[i]) poolErrors++;
+    }
+    if (fs->open("poolx.bin", "w")) poolErrors++; // No buffer left
+    if (fs->exists("poolx.bin")) poolErrors++; // ...and nothing created trying
+    for (int i = FASTROMFS_MAX_WRITE_BUFFERS; i < FASTROMFS_MAX_OPEN_FILES; i++) {
+      h[i] = fs->open("records.bin", "r");
+      if (!h[i]) poolErrors++;
+    }
+    if (fs->open("records.bin", "r")) poolErrors++; // No handle left
+    h[0]->close();
+    h[0] = fs->open("poolx.bin", "w");
+    if (!h[0]) poolErrors++;
+    for (int i = 0; i < FASTROMFS_MAX_OPEN_FILES; i++) if (h[i]) h[i]->close();
+    fs->getStats(&st);
+    if (st.poolExhausted != 2) poolErrors++;
+    DEBUG_FASTROMFS("Pool test: %d errors, %u refused opens\n", poolErrors, st.poolExhausted);
+    if (poolErrors) DEBUG_FASTROMFS("ERROR!  Handle/buffer pools didn't limit or recycle correctly\n");
+  }
+
+  // A burst of renames with no flush in between has to survive a remount (low-RAM mode holds them in RAM)
+  {
+    int renameErrors = 0;
+    for (int i = 0; i < 6; i++) {
+      char from[16], to[16];
+      sprintf(from, "pool%d.bin", i);
+      sprintf(to, "renamed%d.bin", i);
+      if (i < FASTROMFS_MAX_WRITE_BUFFERS) fs->rename(from, to);
+      else {
+        f = fs->open(to, "w");
+        f->write(to, strlen(to));
+        f->close();
+      }
+      fs->rename("records.bin", (i & 1) ? "records.bin.b" : "records.bin.a");
+      fs->rename((i & 1) ? "records.bin.b" : "records.bin.a", "records.bin");
+    }
+    fs->umount();
+    fs->mount();
+    for (int i = 0; i < 6; i++) {
+      char to[16];
+      sprintf(to, "renamed%d.bin", i);
+      if (!fs->exists(to)) renameErrors++;
+    }
+    if (!fs->exists("records.bin") || fs->exists("records.bin.a") || (fs->fsize("records.bin") != 300 * 56)) renameErrors++;
+    DEBUG_FASTROMFS("Rename/remount test: %d errors\n", renameErrors);
+    if (renameErrors) DEBUG_FASTROMFS("ERROR!  Renamed files lost across a remount\n");
+  }
+
+  // A write budget cuts a big write() short at a sector boundary, or yields between flash ops when there's a hook
+  {
+    static uint8_t big[5 * 4096];
+    int budgetErrors = 0, calls = 0, yields = 0;
+    for (int i = 0; i < (int)sizeof(big); i++) big[i] = i * 13;
+    fs->setWriteBudget(0, 2);
+    for (int pass = 0; pass < 2; pass++) {
+      if (pass) fs->setYieldHook(CountYield, &yields);
+      f = fs->open("budget.bin", "w");
+      size_t done = 0;
+      calls = 0;
+      while (done < sizeof(big)) {
+        size_t n = f->write(big + done, sizeof(big) - done);
+        if (!n) break;
+        done += n;
+        calls++;
+      }
+      f->close();
+      f = fs->open("budget.bin", "r");
+      for (int i = 0; i < (int)sizeof(big); i++) if (f->read() != big[i]) { budgetErrors++; break; }
+      f->close();
+#if !FASTROMFS_WRITEBEHIND // Queued sectors don't cost the caller any flash time
+      if (pass ? ((calls != 1) || !yields) : (calls < 2)) budgetErrors++;
+#else
+      if (pass && (calls != 1)) budgetErrors++;
+#endif
+    }
+    fs->setYieldHook(NULL, NULL);
+    fs->setWriteBudget(0, 0);
+    DEBUG_FASTROMFS("Write budget test: %d errors, %d yields\n", budgetErrors, yields);
+    if (budgetErrors) DEBUG_FASTROMFS("ERROR!  Write budget didn't bound the call or lost data\n");
+  }
+
+  // Randomly placed multi-sector files come out contiguous after enough bounded defrag() calls, and still read back
+  {
+    int defragErrors = 0, calls = 0;
+    for (int i = 0; i < 3; i++) {
+      char nm[16];
+      sprintf(nm, "frag%d.bin", i);
+      f = fs->open(nm, "w");
+      for (int j = 0; j < 2000 * (i + 1); j++) f->write((uint8_t)(j * (i + 3)));
+      f->close();
+    }
+    int before = fs->fragments();
+    while (fs->defrag(4) && (calls < 1000)) calls++;
+    int after = fs->fragments();
+    fs->umount();
+    fs->mount();
+    for (int i = 0; i < 3; i++) {
+      char nm[16];
+      sprintf(nm, "frag%d.bin", i);
+      f = fs->open(nm, "r");
+      for (int j = 0; j < 2000 * (i + 1); j++) if (f->read() != (uint8_t)(j * (i + 3))) { defragErrors++; break; }
+      f->close();
+    }
+    if (!before || after || (fs->fragments() != 0) || (calls >= 1000)) defragErrors++;
+    DEBUG_FASTROMFS("Defrag test: %d errors, %d fragments before, %d after, %d calls\n", defragErrors, before, after, calls);
+    if (defragErrors) DEBUG_FASTROMFS("ERROR!  defrag() didn't converge or corrupted a file\n");
+  }
+
+  // Truncation frees the tail sectors with a single metadata write and leaves zeros past the new end
+  {
+    int truncErrors = 0;
+    f = fs->open("trunc.bin", "w");
+    for (int i = 0; i < 5 * 4096; i++) f->write((uint8_t)(i % 251));
+    f->close();
+    fs->umount(); // Nothing left in the write-behind queue to muddy the counts
+    fs->mount();
+    int avail = fs->available();
+    fs->resetStats();
+    if (!fs->truncate("trunc.bin", 5000)) truncErrors++;
+    fs->getStats(&st);
+    if (st.preEraseHits + st.preEraseMisses != 1) truncErrors++; // Only the metadata sector, data is zeroed in place
+    if ((fs->fsize("trunc.bin") != 5000) || (fs->available() != avail + 3 * 4096)) truncErrors++;
+    f = fs->open("trunc.bin", "r+");
+    f->seek(6000);
+    f->write((uint8_t)'X');
+    f->seek(0);
+    for (int i = 0; i < 6001; i++) {
+      int c = f->read();
+      if (c != ((i < 5000) ? (i % 251) : (i < 6000) ? 0 : 'X')) { truncErrors++; break; }
+    }
+    // Unflushed data in the buffered sector gets cut too
+    f->seek(100);
+    f->write("0123456789", 10);
+    if (!f->truncate(105) || (f->size() != 105)) truncErrors++;
+    f->close();
+    f = fs->open("trunc.bin", "r");
+    len = f->read(buff, 200);
+    f->close();
+    if ((len != 105) || memcmp(buff + 100, "01234", 5) || (buff[99] != 99)) truncErrors++;
+    DEBUG_FASTROMFS("Truncate test: %d errors\n", truncErrors);
+    if (truncErrors) DEBUG_FASTROMFS("ERROR!  truncate() lost data, left garbage or cost extra flushes\n");
+  }
+
+  // A circular log trims whole sectors off its head as it appends, offsets stay put and the footprint stays bounded
+  {
+    int logErrors = 0, minAvail = fs->available();
+    f = fs->open("events.log", "a+");
+    for (int i = 0; i < 40000; i++) {
+      f->write((uint8_t)(i % 253));
+      if ((i % 1000 == 999) && (f->size() - f->head() > 3 * 4096)) {
+        if (f->trim(f->size() - 2 * 4096) < 0) logErrors++;
+        if (fs->available() < minAvail) minAvail = fs->available();
+      }
+    }
+    int logHead = f->head();
+    if ((logHead < 40000 - 4 * 4096) || (logHead % 4096)) logErrors++;
+    f->seek(0); // Lands on the head
+    if ((f->tell() != logHead) || (f->read() != logHead % 253)) logErrors++;
+    f->close();
+    fs->umount();
+    fs->mount();
+    f = fs->open("events.log", "r");
+    if ((f->head() != logHead) || (f->size() != 40000)) logErrors++;
+    if ((f->tell() != logHead) || (f->available() != 40000 - logHead)) logErrors++; // A new handle starts at the head
+    for (int i = logHead; i < 40000; i++) if (f->read() != i % 253) { logErrors++; break; }
+    f->close();
+    int logAvail = fs->available();
+    f = fs->open("events.log", "r+");
+    if ((f->write("hello", 5) != 5) || (f->tell() != logHead + 5)) logErrors++;
+    f->close();
+    if (fs->available() != logAvail) logErrors++; // Rewritten in place, not appended past a chain walk gone wrong
+    f = fs->open("events.log", "r");
+    char hello[6] = { 0 };
+    if ((f->read(hello, 5) != 5) || strcmp(hello, "hello") || (f->read() != (logHead + 5) % 253)) logErrors++;
+    f->close();
+    if (fs->trim("events.log", 40000) != 36864) logErrors++; // The sector holding the end stays
+    DEBUG_FASTROMFS("Circular log test: %d errors, head=%d, low water %d bytes free\n", logErrors, logHead, minAvail);
+    if (logErrors) DEBUG_FASTROMFS("ERROR!  Trimmed log lost its place or its data\n");
+  }
+
+  // Key-value records survive overwrites, deletes, compaction and a remount, and a get() is one small read
+  {
+    int kvErrors = 0;
+    FastROMKV *kv = new FastROMKV();
+    if (!kv->begin(fs, "settings.kv")) kvErrors++;
+    char key[16], val[32];
+    for (int gen = 0; gen < 10; gen++) {
+      for (int i = 0; i < 150; i++) {
+        sprintf(key, "key%d", i);
+        sprintf(val, "value%d-%d", i, gen);
+        if (!kv->put(key, val, strlen(val) + 1)) { kvErrors++; break; }
+      }
+      kv->compact(2);
+    }
+    for (int i = 0; i < 150; i += 3) {
+      sprintf(key, "key%d", i);
+      if (!kv->remove(key)) kvErrors++;
+    }
+    if (kv->remove("key0") || (kv->get("key0", val, sizeof(val)) != -1)) kvErrors++;
+    if (kv->get("key149", val, -1) != -1) kvErrors++; // Would have been a huge memcpy
+    while (kv->compact(4)) { /* reclaim everything */ }
+    if (kv->count() != 100) kvErrors++;
+    fs->resetStats();
+    if ((kv->get("key149", val, sizeof(val)) != 11) || strcmp(val, "value149-9")) kvErrors++;
+    fs->getStats(&st);
+    if (st.bytesRead > 256) kvErrors++;
+    kv->end();
+    fs->umount();
+    fs->mount();
+    if (!kv->begin(fs, "settings.kv") || (kv->count() != 100)) kvErrors++;
+    for (int i = 0; i < 150; i++) {
+      sprintf(key, "key%d", i);
+      sprintf(val, "value%d-9", i);
+      char got[32];
+      int len = kv->get(key, got, sizeof(got));
+      if ((i % 3) ? ((len != (int)strlen(val) + 1) || strcmp(got, val)) : (len != -1)) { kvErrors++; break; }
+    }
+    DEBUG_FASTROMFS("KV test: %d errors, %d keys, %d bytes read per get\n", kvErrors, kv->count(), st.bytesRead);
+    delete kv;
+    if (kvErrors) DEBUG_FASTROMFS("ERROR!  Key-value store lost or mangled records\n");
+  }
+
+  // Fill the directory, then find everything again by name and by prefix, across a remount.  Past 64 entries
+  // (FASTROMFS_MAX_FILES) this runs into the directory chain.
+  {
+    int dirErrors = 0, made = 0;
+    char nm[32];
+    for (made = 0; made < 200; made++) {
+      sprintf(nm, "many/%03d", made);
+      f = fs->open(nm, "w");
+      if (!f) break;
+      f->write(nm, strlen(nm));
+      f->close();
+    }
+    if ((FASTROMFS_MAX_FILES > 200) && (made != 200)) dirErrors++;
+    for (int pass = 0; pass < 2; pass++) {
+      for (int i = 0; i < made; i++) {
+        sprintf(nm, "many/%03d", i);
+        if (fs->fsize(nm) != 8) { dirErrors++; break; }
+      }
+      int listed = 0, all = 0;
+      d = fs->opendir("many/");
+      while (struct FastROMFSDirent *de = fs->readdir(d)) {
+        if (strncmp(de->name, "many/", 5) || (de->len != 8)) dirErrors++;
+        listed++;
+      }
+      fs->closedir(d);
+      d = fs->opendir("/");
+      while (fs->readdir(d)) all++;
+      fs->closedir(d);
+      if ((listed != made) || (all <= made)) dirErrors++;
+      fs->umount();
+      fs->mount();
+    }
+    fs->rename("many/000", "many/zzz");
+    if (fs->exists("many/000") || (fs->fsize("many/zzz") != 8)) dirErrors++;
+    fs->unlink("many/zzz");
+    for (int i = 1; i < made; i++) {
+      sprintf(nm, "many/%03d", i);
+      if (!fs->unlink(nm)) dirErrors++;
+    }
+    d = fs->opendir("many/");
+    if (fs->readdir(d)) dirErrors++;
+    fs->closedir(d);
+    DEBUG_FASTROMFS("Directory test: %d errors, %d files\n", dirErrors, made);
+    if (dirErrors) DEBUG_FASTROMFS("ERROR!  Directory lost track of a file\n");
+  }
+
+#ifndef ARDUINO
+  // Compressed assets read back byte for byte from anywhere, in fewer sectors and fewer flash bytes
+  {
+    int zErrors = 0;
+    static char page[30000];
+    int plen = 0;
+    for (int i = 0; plen < (int)sizeof(page) - 100; i++) {
+      plen += sprintf(page + plen, "<tr><td class=\"row\">%d</td><td>item %d</td></tr>\n", i, (i * 7919) % 1000);
+    }
+    int before = fs->available();
+    if (!fs->writeCompressed("index.html", page, plen)) zErrors++;
+    int used = before - fs->available();
+    if ((fs->fsize("index.html") != plen) || (used >= plen)) zErrors++;
+    f = fs->open("index.html", "r");
+    if (!f || (f->size() != plen)) zErrors++;
+    FastROMFSStats zst;
+    fs->resetStats();
+    static char back[sizeof(page)];
+    if (f->read(back, sizeof(back)) != plen || memcmp(back, page, plen)) zErrors++;
+    fs->getStats(&zst);
+    if (zst.bytesRead >= (uint32_t)plen) zErrors++;
+    srand(7);
+    for (int i = 0; i < 200; i++) {
+      int off = rand() % plen, n = rand() % 300;
+      f->seek(off);
+      int got = f->read(buff, n);
+      if ((got != ((n < plen - off) ? n : plen - off)) || memcmp(buff, page + off, got)) { zErrors++; break; }
+    }
+    f->seek(-10, SEEK_END);
+    for (int i = plen - 10; i < plen; i++) if (f->read() != page[i]) zErrors++;
+    if (!f->eof() || (f->read() != -1)) zErrors++;
+    f->close();
+    if (fs->open("index.html", "r+") || fs->open("index.html", "a") || fs->truncate("index.html", 10)) zErrors++;
+    fs->umount();
+    fs->mount();
+    f = fs->open("index.html", "r");
+    f->seek(12345);
+    if ((f->read(back, 100) != 100) || memcmp(back, page + 12345, 100)) zErrors++;
+    f->close();
+    f = fs->open("index.html", "w"); // Back to a plain file
+    f->write("plain", 5);
+    f->close();
+    if (fs->fsize("index.html") != 5) zErrors++;
+    fs->unlink("index.html");
+    DEBUG_FASTROMFS("Compressed file test: %d errors, %d bytes in %d, %u flash bytes read\n", zErrors, plen, used, zst.bytesRead);
+    if (zErrors) DEBUG_FASTROMFS("ERROR!  Compressed file didn't read back right\n");
+  }
+#endif
+
+#ifndef ARDUINO
+  // sendTo() into a slow sink, with both buffers, with one buffer split in two, and with none left
+  {
+    static uint8_t src[3 * 4096 + 1000], dst[sizeof(src)];
+    int sErrors = 0;
+    for (int i = 0; i < (int)sizeof(src); i++) src[i] = (i * 7 + i / 251) & 0xff;
+    f = fs->open("send.bin", "w");
+    f->write(src, sizeof(src));
+    f->close();
+    fs->resetStats();
+    f = fs->open("send.bin", "r");
+    f->seek(100);
+    MemSink all(dst, sizeof(dst), 3, sizeof(dst));
+    int sent = f->sendTo(all);
+    if ((sent != (int)sizeof(src) - 100) || memcmp(dst, src + 100, sent) || (f->tell() != (int)sizeof(src))) sErrors++;
+    FastROMFile *hog = fs->open("sendhog1.bin", "w");
+    f->seek(5000);
+    MemSink part(dst, sizeof(dst), 1, sizeof(dst));
+    sent = f->sendTo(part, 3000);
+    if ((sent != 3000) || memcmp(dst, src + 5000, sent) || (f->tell() != 8000)) sErrors++;
+    f->seek(0);
+    MemSink dropped(dst, sizeof(dst), 2, 6000);
+    sent = f->sendTo(dropped);
+    if ((sent != 6000) || memcmp(dst, src, sent) || (f->tell() != 6000)) sErrors++; // Unsent read-ahead given back
+    FastROMFile *hog2 = fs->open("sendhog2.bin", "w");
+    if (f->sendTo(all) != -1) sErrors++;
+    hog2->close();
+    hog->close();
+    f->close();
+    fs->getStats(&st);
+    if (st.poolExhausted != 1) sErrors++; // Only the refusal, not the split buffer
+    DEBUG_FASTROMFS("sendTo test: %d errors, %u read-aheads while the sink was busy\n", sErrors, st.sendReadAheads);
+    if (sErrors || !st.sendReadAheads) DEBUG_FASTROMFS("ERROR!  sendTo() sent the wrong bytes\n");
+  }
+#endif
+
+  // Clones share sectors until one side writes, and only grow apart where they do
+  {
+    int cErrors = 0;
+    f = fs->open("orig.bin", "w");
+    for (int i = 0; i < 5 * 4096; i++) f->fputc(i % 251);
+    f->sync(); // Nothing left queued to be counted against the clone
+    f->close();
+    int avail = fs->available();
+    fs->resetStats();
+    if (!fs->clone("orig.bin", "copy.bin")) cErrors++;
+    fs->getStats(&st);
+    if ((fs->available() != avail) || (st.sectorWrites > 1)) cErrors++; // Just the metadata
+    if (fs->clone("orig.bin", "copy.bin") || fs->clone("nothere.bin", "copy2.bin")) cErrors++;
+    f = fs->open("orig.bin", "r+");
+    f->seek(2 * 4096 + 10);
+    f->write("XXXX", 4);
+    f->close();
+    if (avail - fs->available() != 3 * 4096) cErrors++; // Two sectors leading up to it, and the one written
+    cErrors += CheckPattern(fs, "orig.bin", 5 * 4096, 2 * 4096 + 10);
+    cErrors += CheckPattern(fs, "copy.bin", 5 * 4096, -4);
+    f = fs->open("copy.bin", "a");
+    for (int i = 5 * 4096; i < 5 * 4096 + 100; i++) f->fputc(i % 251);
+    f->close();
+    fs->clone("copy.bin", "copy2.bin");
+    fs->truncate("copy2.bin", 5000);
+    while (fs->defrag(8)) { /* shared sectors have to stay put */ }
+    fs->umount();
+    fs->mount();
+    cErrors += CheckPattern(fs, "orig.bin", 5 * 4096, 2 * 4096 + 10);
+    cErrors += CheckPattern(fs, "copy.bin", 5 * 4096 + 100, -4);
+    cErrors += CheckPattern(fs, "copy2.bin", 5000, -4);
+    fs->unlink("orig.bin");
+    fs->unlink("copy.bin");
+    cErrors += CheckPattern(fs, "copy2.bin", 5000, -4);
+    fs->unlink("copy2.bin");
+    if (fs->available() != avail + 5 * 4096) cErrors++; // Everything back, nothing leaked or freed twice
+    DEBUG_FASTROMFS("Clone test: %d errors\n", cErrors);
+    if (cErrors) DEBUG_FASTROMFS("ERROR!  Clones didn't keep their own contents\n");
+  }
+
+#ifndef ARDUINO
+  // Same seed and same calls give the same flash image, whatever else is going on in the process
+  {
+    FILE *img[2];
+    for (int n = 0; n < 2; n++) {
+      FastROMFilesystem *sfs = new FastROMFilesystem(64);
+      sfs->setRandomSeed(1234);
+      sfs->mkfs();
+      sfs->mount();
+      for (int i = 0; i < 6; i++) {
+        char nm[16];
+        sprintf(nm, "seed%d.bin", i);
+        FastROMFile *sf = sfs->open(nm, "w");
+        for (int j = 0; j < 500 * i; j++) sf->write(nm, strlen(nm));
+        sf->close();
+        if (i == 3) sfs->unlink("seed1.bin");
+      }
+      sfs->umount();
+      img[n] = tmpfile();
+      sfs->DumpToFile(img[n]);
+      delete sfs;
+      rand(); // Shouldn't matter
+    }
+    rewind(img[0]);
+    rewind(img[1]);
+    int c0, c1, diffs = 0;
+    do {
+      c0 = fgetc(img[0]);
+      c1 = fgetc(img[1]);
+      if (c0 != c1) diffs++;
+    } while ((c0 != EOF) && (c1 != EOF));
+    fclose(img[0]);
+    fclose(img[1]);
+    DEBUG_FASTROMFS("Seeded layout test: %d differing bytes\n", diffs);
+    if (diffs) DEBUG_FASTROMFS("ERROR!  Same seed gave different flash images\n");
+  }
+#endif
+
+#if !defined(ARDUINO) && (FASTROMFS_MAX_FILES > FILEENTRIES)
+  // The directory chain's first sector can sit in a slot defrag() wants for a file, and has to be moved out of the way
+  {
+    int dfErrors = 0;
+    for (int seed = 1; seed <= 20; seed++) {
+      FastROMFilesystem *dfs = new FastROMFilesystem(128);
+      dfs->setRandomSeed(seed);
+      dfs->mkfs();
+      dfs->mount();
+      char nm[16];
+      for (int i = 0; i < 70; i++) {
+        sprintf(nm, "d%03d", i);
+        f = dfs->open(nm, "w");
+        f->write(nm, strlen(nm));
+        f->close();
+      }
+      for (int i = 0; i < 3; i++) {
+        sprintf(nm, "dbig%d", i);
+        f = dfs->open(nm, "w");
+        for (int j = 0; j < 9000; j++) f->write((uint8_t)(j * (i + 5)));
+        f->close();
+      }
+      int calls = 0;
+      while (dfs->defrag(4) && (calls < 1000)) calls++;
+      if (dfs->fragments() || (calls >= 1000)) dfErrors++;
+      dfs->umount();
+      dfs->mount();
+      for (int i = 0; i < 70; i++) {
+        sprintf(nm, "d%03d", i);
+        if (dfs->fsize(nm) != 4) { dfErrors++; break; }
+      }
+      for (int i = 0; i < 3; i++) {
+        sprintf(nm, "dbig%d", i);
+        f = dfs->open(nm, "r");
+        for (int j = 0; j < 9000; j++) if (f->read() != (uint8_t)(j * (i + 5))) { dfErrors++; break; }
+        f->close();
+      }
+      dfs->umount();
+      delete dfs;
+    }
+    DEBUG_FASTROMFS("Directory chain defrag test: %d errors\n", dfErrors);
+    if (dfErrors) DEBUG_FASTROMFS("ERROR!  defrag() stopped at the directory chain or lost it\n");
+  }
+#endif
+
+#ifndef ARDUINO
+  // On a nearly full filesystem a sector freed by copy-on-write goes straight to the next KV sector, which is erased
+  // directly instead of queued.  Its old copy may still be waiting to be programmed and must not land on the records.
+  {
+    int qErrors = 0;
+    FastROMFilesystem *qfs = new FastROMFilesystem(64);
+#if FASTROMFS_WRITEBEHIND
+    qfs->setWriteBehind(true);
+#endif
+    qfs->mkfs();
+    qfs->mount();
+    f = qfs->open("cow.bin", "w");
+    for (int i = 0; i < 6000; i++) f->fputc(i % 251);
+    f->close();
+    FastROMKV *qkv = new FastROMKV();
+    if (!qkv->begin(qfs, "late.kv")) qErrors++;
+    char key[16], val[64];
+    for (int i = 0; i < 88; i++) {
+      if (i == 64) { // 64-byte records, the first sector is exactly full
+        int fill = qfs->available() - 4096; // Leave one sector free
+        f = qfs->open("fill.bin", "w");
+        for (int j = 0; j < fill; j++) f->fputc(0);
+        f->close();
+        if (qfs->available() != 4096) qErrors++;
+        qfs->SetSimulatedLatency(0, 5000, 20000); // Keep the queue from draining while the main thread moves on
+        f = qfs->open("cow.bin", "r+");
+        f->seek(10);
+        f->write("AAAA", 4);
+        f->close(); // Copied to the last free sector and queued, the original is freed
+        f = qfs->open("cow.bin", "r+");
+        f->seek(10);
+        f->write("XXXX", 4);
+        f->close(); // Copied back, freeing the sector whose copy is still queued
+      }
+      sprintf(key, "kv%06d", i);
+      sprintf(val, "v%046d", i);
+      if (!qkv->put(key, val, strlen(val) + 1)) qErrors++;
+    }
+    qkv->end();
+    qfs->umount();
+    qfs->mount();
+    if (!qkv->begin(qfs, "late.kv") || (qkv->count() != 88)) qErrors++;
+    for (int i = 0; i < 88; i++) {
+      sprintf(key, "kv%06d", i);
+      sprintf(val, "v%046d", i);
+      char got[64];
+      if ((qkv->get(key, got, sizeof(got)) != (int)strlen(val) + 1) || strcmp(got, val)) qErrors++;
+    }
+    delete qkv;
+    qErrors += CheckPattern(qfs, "cow.bin", 6000, 10);
+    qfs->umount();
+    delete qfs;
+    DEBUG_FASTROMFS("Write-behind reuse test: %d errors\n", qErrors);
+    if (qErrors) DEBUG_FASTROMFS("ERROR!  Stale queued sector overwrote a new owner\n");
+  }
+#endif
+
   f = fs->open("gettysburg.txt", "r");
   DEBUG_FASTROMFS("fgetc test: '");
   while (1) {
@@ -205,6 +912,9 @@ int main(int argc, char **argv)
 
 
   delete fs;
+#if FASTROMFS_TRACE && !defined(ARDUINO)
+  if (traceFile) fclose(traceFile);
+#endif
 
 }
 
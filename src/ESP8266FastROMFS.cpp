@@ -25,9 +25,12 @@
 #include <string.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <stddef.h>
 #include <time.h>
+#include <unistd.h>
 #endif
 
+#include <new>
 #include <ESP8266FastROMFS.h>
 
 #ifndef DEBUGFASTROMFS
@@ -48,9 +51,78 @@
 #define max(a,b) (((a)>(b))?(a):(b))
 #endif
 
+#if FASTROMFS_THREADSAFE
+// Scoped reader/writer lock.  Only taken at public entry points, internal helpers assume it's held
+class FastROMFSLock
+{
+  public:
+    FastROMFSLock(pthread_rwlock_t *lock, bool exclusive) {
+      this->lock = lock;
+      if (exclusive) pthread_rwlock_wrlock(lock);
+      else pthread_rwlock_rdlock(lock);
+    }
+    ~FastROMFSLock() {
+      pthread_rwlock_unlock(lock);
+    }
+  private:
+    pthread_rwlock_t *lock;
+};
+  #define FASTROMFS_LOCK_SHARED(fs) FastROMFSLock fsLockGuard(&(fs)->fsLock, false)
+  #define FASTROMFS_LOCK_EXCLUSIVE(fs) FastROMFSLock fsLockGuard(&(fs)->fsLock, true)
+#else
+  #define FASTROMFS_LOCK_SHARED(fs)
+  #define FASTROMFS_LOCK_EXCLUSIVE(fs)
+#endif
+
+// Read paths only hold the shared lock, so their counters can be bumped by several tasks at once
+#if FASTROMFS_THREADSAFE
+  #define FASTROMFS_STAT_ADD(field, n) __atomic_fetch_add(&stats.field, (n), __ATOMIC_RELAXED)
+#else
+  #define FASTROMFS_STAT_ADD(field, n) (stats.field += (n))
+#endif
+
+#if FASTROMFS_TRACE
+  #define FASTROMFS_TRACE_CALL(fs, op, f, arg, a, b) (fs)->Trace(op, f, arg, a, b)
+#else
+  #define FASTROMFS_TRACE_CALL(fs, op, f, arg, a, b)
+#endif
+
+#if FASTROMFS_INSTRUMENT
+// Scoped latency measurement, records when it goes out of scope so every early return is counted
+class FastROMFSOpTimer
+{
+  public:
+    FastROMFSOpTimer(FastROMFilesystem *fs, int op, int sector) {
+      this->fs = fs;
+      this->op = op;
+      this->sector = sector;
+      start = FastROMFilesystem::Micros();
+    }
+    ~FastROMFSOpTimer() {
+      fs->RecordLatency(op, sector, FastROMFilesystem::Micros() - start);
+    }
+  private:
+    FastROMFilesystem *fs;
+    int op;
+    int sector;
+    uint32_t start;
+};
+  #define FASTROMFS_TIME_OP(fs, op, sector) FastROMFSOpTimer opTimer(fs, op, sector)
+#else
+  #define FASTROMFS_TIME_OP(fs, op, sector)
+#endif
+
+// Flash ops can run on the write-behind thread while other tasks read, so their counters and histograms need atomic updates too
+#if FASTROMFS_THREADSAFE || (FASTROMFS_WRITEBEHIND && !defined(ARDUINO))
+  #define FASTROMFS_ATOMIC_ADD(var, n) __atomic_fetch_add(&(var), (n), __ATOMIC_RELAXED)
+#else
+  #define FASTROMFS_ATOMIC_ADD(var, n) ((var) += (n))
+#endif
+
 
 bool FastROMFilesystem::exists(const char *name)
 {
+  FASTROMFS_LOCK_SHARED(this);
   if (!fsIsMounted) return false;
 
   if (FindFileEntryByName(name) >= 0) return true;
@@ -59,6 +131,8 @@ bool FastROMFilesystem::exists(const char *name)
 
 bool FastROMFilesystem::rename(const char *old, const char *newName)
 {
+  FASTROMFS_TRACE_CALL(this, FASTROMFS_TRACE_RENAME, NULL, 0, TraceNameHash(old), TraceNameHash(newName));
+  FASTROMFS_LOCK_EXCLUSIVE(this);
   if (!fsIsMounted) return false;
   int idx = FindFileEntryByName(old);
   int newIdx = FindFileEntryByName(newName);
@@ -69,79 +143,399 @@ bool FastROMFilesystem::rename(const char *old, const char *newName)
   return false;
 }
 
+bool FastROMFilesystem::clone(const char *src, const char *dest)
+{
+  FASTROMFS_TRACE_CALL(this, FASTROMFS_TRACE_CLONE, NULL, 0, TraceNameHash(src), TraceNameHash(dest));
+  FASTROMFS_LOCK_EXCLUSIVE(this);
+  if (!fsIsMounted || !src || !dest || !dest[0]) return false;
+  int idx = FindFileEntryByName(src);
+  if ((idx < 0) || (FindFileEntryByName(dest) >= 0)) return false;
+  int newIdx = FindFreeFileEntry();
+  if (newIdx < 0) return false;
+  StartBudget();
+  // Anything a writer still has buffered belongs in both
+  for (int i = 0; i < FASTROMFS_MAX_OPEN_FILES; i++) {
+    if (!(handleUsed & (1UL << i))) continue;
+    FastROMFile *h = reinterpret_cast<FastROMFile*>(handlePool[i]);
+    if ((h->fileIdx == idx) && h->shared->dataDirty) {
+      if (!h->FlushData()) return false;
+      break;
+    }
+  }
+  SetFileEntryName(newIdx, dest);
+  Entry(newIdx).fat = Entry(idx).fat; // First sector, trimmed head and compression all carry over
+  Entry(newIdx).len = Entry(idx).len;
+  EntryChanged(newIdx);
+  clones = true;
+  return FlushFAT();
+}
+
 
 void FastROMFilesystem::GetFileEntryName(int idx, char *dest)
 {
-  memcpy(dest, fs.md.fileEntry[idx].name, NAMELEN);
+#if FASTROMFS_LOWRAM
+  memset(dest, 0, NAMELEN);
+  if (!nameHash[idx]) return;
+  for (int i = 0; i < FASTROMFS_LOWRAM_NAMES; i++) {
+    if (pendingName[i].idx == idx) {
+      memcpy(dest, pendingName[i].name, NAMELEN);
+      return;
+    }
+  }
+  // Unchanged since the last flush, so the newest metadata sector has it.  FileEntry starts with the name.
+  ReadPartialSector(fatSector[0], offsetof(FilesystemInFlash, md.fileEntry) + idx * sizeof(FileEntry), dest, NAMELEN);
+#else
+  memcpy(dest, Entry(idx).name, NAMELEN);
+#endif
 }
 
 int FastROMFilesystem::GetFileEntryLen(int idx)
 {
-  return fs.md.fileEntry[idx].len;
+  return Entry(idx).len;
 }
 
+#define FATHEADSHIFT 12 // FileEntry.fat bits above this count sectors trimmed off the head
+#define FATHEADMASK 0x7ffff // Enough for any offset an int32_t len can reach
+#define MAXFILEOFFSET (FATHEADMASK * SECTORSIZE) // A sector short of INT32_MAX, so write(uint8_t) can't step past it either
+
 int FastROMFilesystem::GetFileEntryFAT(int idx)
 {
-  return fs.md.fileEntry[idx].fat;
+  return Entry(idx).fat & FATEOF;
+}
+
+// Offset of the first byte still in the file, 0 unless it's been trimmed
+int FastROMFilesystem::GetFileEntryHead(int idx)
+{
+  return ((Entry(idx).fat >> FATHEADSHIFT) & FATHEADMASK) * SECTORSIZE;
+}
+
+#define FATCOMPRESSED 0x80000000UL // FileEntry.fat flag, the data is a compressed image from writeCompressed()
+#define SENDMINWRITE 256 // sendTo() treats less room than this in the destination as none
+
+bool FastROMFilesystem::GetFileEntryCompressed(int idx)
+{
+  return ((uint32_t)Entry(idx).fat & FATCOMPRESSED) != 0;
+}
+
+// Compressed file layout: this header, then blocks + 1 file offsets of each block's data (the last one is the end of
+// the file), then the blocks.  Each block decodes to SECTORSIZE bytes (less for the last one) without needing any
+// other, so a seek only decodes one.  A block that doesn't shrink is stored as is.  Encoding is LZSS: a flag byte,
+// LSB first, then for each bit a literal (1) or a 2 byte match (0) of distance - 1 in 12 bits and length - 3 in 4.
+#define ZMAGIC 0x315a5246 // "FRZ1"
+#define ZMINMATCH 3
+#define ZMAXMATCH 18
+typedef struct {
+  uint32_t magic;
+  int32_t rawLen;
+  int32_t blocks;
+} ZHeader;
+
+int FastROMFilesystem::GetFileEntryDataLen(int idx)
+{
+  if (!GetFileEntryCompressed(idx)) return GetFileEntryLen(idx);
+  ZHeader hdr; // Compressed files are never trimmed, so this is at the start of the first sector
+  if (!ReadPartialSector(GetFileEntryFAT(idx), 0, &hdr, sizeof(hdr)) || (hdr.magic != ZMAGIC)) return 0;
+  return hdr.rawLen;
 }
 
 void FastROMFilesystem::SetFileEntryName(int idx, const char *src)
 {
+#if FASTROMFS_LOWRAM
+  int slot = -1;
+  for (int i = 0; i < FASTROMFS_LOWRAM_NAMES; i++) {
+    if (pendingName[i].idx == idx) slot = i;
+  }
+  if (!src[0]) { // Deleting, nothing to remember
+    if (slot >= 0) pendingName[slot].idx = -1;
+  } else {
+    if (slot < 0) {
+      for (int pass = 0; (pass < 2) && (slot < 0); pass++) {
+        if (pass) FlushFAT(); // Write out what we have so far to free every slot
+        for (int i = 0; i < FASTROMFS_LOWRAM_NAMES; i++) {
+          if (pendingName[i].idx < 0) slot = i;
+        }
+      }
+      if (slot < 0) return; // Flush failed, can't take the new name
+    }
+    pendingName[slot].idx = idx;
+    strncpy(pendingName[slot].name, src, NAMELEN);
+  }
+  nameHash[idx] = NameHash(src);
+#elif FASTROMFS_MAX_FILES > FILEENTRIES
+  if (Entry(idx).name[0]) NameIndexRemove(idx);
+  memset(Entry(idx).name, 0, NAMELEN); // Same as strncpy(), minus the warning about a full name losing its \0
+  memcpy(Entry(idx).name, src, strnlen(src, NAMELEN));
+  if (src[0]) NameIndexAdd(idx);
+#else
   strncpy(fs.md.fileEntry[idx].name, src, NAMELEN);
-  fsIsDirty = true;
+#endif
+  EntryChanged(idx);
 }
 
 void FastROMFilesystem::SetFileEntryLen(int idx, int len)
 {
-  fs.md.fileEntry[idx].len = len;
-  fsIsDirty = true;
+  Entry(idx).len = len;
+  EntryChanged(idx);
 }
 
 
 void FastROMFilesystem::SetFileEntryFAT(int idx, int fat)
 {
-  fs.md.fileEntry[idx].fat = fat;
-  fsIsDirty = true;
+  Entry(idx).fat = (Entry(idx).fat & ~FATEOF) | fat;
+  EntryChanged(idx);
 }
 
 #ifndef ARDUINO
 void FastROMFilesystem::DumpToFile(FILE *f)
 {
   if (fsIsMounted) return; // Can't dump a mounted FS!
-  for (int i=0; i < fs.md.sectors; i++)
-    fwrite(flash[i], SECTORSIZE, 1, f);
+  uint8_t buff[SECTORSIZE];
+  for (int i=0; i < fs.md.sectors; i++) {
+    SimRead(i, 0, buff, SECTORSIZE);
+    fwrite(buff, SECTORSIZE, 1, f);
+  }
 }
 
+// Only reads as much as the image holds, and blank sectors stay unallocated
 void FastROMFilesystem::LoadFromFile(FILE *f)
 {
   if (fsIsMounted) return;
-  for (size_t i=0; i<MAXFATENTRIES; i++)
-    fread(flash[i], SECTORSIZE, 1, f);
+  uint8_t buff[SECTORSIZE];
+  for (uint32_t i=0; i<totalSectors; i++) {
+    SimErase(i);
+    if (fread(buff, SECTORSIZE, 1, f) != 1) continue;
+    bool blank = true;
+    for (int j = 0; blank && (j < SECTORSIZE); j++) blank = (buff[j] == 0xff);
+    if (!blank) memcpy(SimProgram(i), buff, SECTORSIZE);
+  }
+  memset(erasedMap, 0, sizeof(erasedMap)); // Whatever we knew is gone
+}
+
+void FastROMFilesystem::SimRead(int sector, int offset, void *dest, int len)
+{
+  if (flash[sector]) memcpy(dest, &flash[sector][offset], len);
+  else memset(dest, 0xff, len);
+}
+
+// Programming can only clear bits, so an erased sector gets real storage the first time it's touched
+uint8_t *FastROMFilesystem::SimProgram(int sector)
+{
+  if (!flash[sector]) {
+    flash[sector] = (uint8_t*)malloc(SECTORSIZE);
+    memset(flash[sector], 0xff, SECTORSIZE);
+  }
+  return flash[sector];
+}
+
+void FastROMFilesystem::SimErase(int sector)
+{
+  free(flash[sector]);
+  flash[sector] = NULL;
+}
+
+// Greedy LZSS over one block, hash chains on 3 bytes.  Returns the encoded length, or len if it didn't shrink.
+// Host only, so the 16KB of chains can just be static.
+static int ZCompressBlock(const uint8_t *src, int len, uint8_t *dest)
+{
+  static int16_t head[4096], prev[SECTORSIZE];
+  memset(head, 0xff, sizeof(head));
+  int o = 0;
+  int flagPos = -1;
+  int bit = 8;
+  for (int i = 0; i < len; ) {
+    if (bit == 8) {
+      if (o + 1 + 8 * 2 > len) return len; // Not going to beat storing it
+      flagPos = o++;
+      dest[flagPos] = 0;
+      bit = 0;
+    }
+    int bestLen = 0, bestDist = 0;
+    if (i + ZMINMATCH <= len) {
+      int h = ((src[i] << 4) ^ (src[i + 1] << 2) ^ src[i + 2]) & 0xfff;
+      int depth = 0;
+      for (int j = head[h]; (j >= 0) && (depth < 64); j = prev[j], depth++) {
+        int n = 0;
+        while ((n < ZMAXMATCH) && (i + n < len) && (src[j + n] == src[i + n])) n++;
+        if (n > bestLen) {
+          bestLen = n;
+          bestDist = i - j;
+          if (n == ZMAXMATCH) break;
+        }
+      }
+    }
+    int step = (bestLen >= ZMINMATCH) ? bestLen : 1;
+    if (step > 1) {
+      dest[o++] = (bestDist - 1) & 0xff;
+      dest[o++] = ((bestDist - 1) >> 8) | ((bestLen - ZMINMATCH) << 4);
+    } else {
+      dest[flagPos] |= 1 << bit;
+      dest[o++] = src[i];
+    }
+    bit++;
+    for (int k = 0; k < step; k++, i++) { // Every position goes in the chains, match or not
+      if (i + ZMINMATCH > len) continue;
+      int h = ((src[i] << 4) ^ (src[i + 1] << 2) ^ src[i + 2]) & 0xfff;
+      prev[i] = head[h];
+      head[h] = i;
+    }
+  }
+  return (o < len) ? o : len;
+}
+
+// The whole compressed image in one malloc'd buffer.  Returns its length, or len when compressing didn't help (and
+// *out is NULL), or -1 on error.
+static int ZBuildImage(const uint8_t *src, int len, uint8_t **out)
+{
+  *out = NULL;
+  int blocks = (len + SECTORSIZE - 1) / SECTORSIZE;
+  int hdrLen = sizeof(ZHeader) + (blocks + 1) * sizeof(uint32_t);
+  uint8_t *img = reinterpret_cast<uint8_t*>(malloc(hdrLen + len + SECTORSIZE));
+  if (!img) return -1;
+  ZHeader hdr = { ZMAGIC, len, blocks };
+  memcpy(img, &hdr, sizeof(hdr));
+  uint32_t *where = reinterpret_cast<uint32_t*>(img + sizeof(hdr));
+  int o = hdrLen;
+  for (int b = 0; b < blocks; b++) {
+    where[b] = o;
+    int n = min(SECTORSIZE, len - b * SECTORSIZE);
+    int z = ZCompressBlock(src + b * SECTORSIZE, n, img + o);
+    if (z == n) memcpy(img + o, src + b * SECTORSIZE, n);
+    o += z;
+  }
+  where[blocks] = o;
+  if (o >= len) {
+    free(img);
+    return len;
+  }
+  *out = img;
+  return o;
+}
+
+bool FastROMFilesystem::writeCompressed(const char *name, const void *data, int len)
+{
+  if (!name || (len < 0) || (len && !data)) return false;
+  uint8_t *img;
+  int o = ZBuildImage(reinterpret_cast<const uint8_t*>(data), len, &img);
+  if (o < 0) return false;
+  FastROMFile *f = open(name, "w");
+  bool ok = f && (f->write(img ? img : reinterpret_cast<const uint8_t*>(data), o) == (size_t)o);
+  if (f && f->close()) ok = false;
+  free(img);
+  if (!ok || !img) return ok;
+  FASTROMFS_LOCK_EXCLUSIVE(this);
+  int idx = FindFileEntryByName(name);
+  if (idx < 0) return false;
+  Entry(idx).fat |= FATCOMPRESSED;
+  EntryChanged(idx);
+  return FlushFAT();
+}
+
+// First fit on a run of free sectors, so a fresh image fills up front to back in the order files are added.  Every
+// sector is programmed once, and all of the metadata waits for one flush at umount().
+bool FastROMFilesystem::writeContiguous(const char *name, const void *data, int len, bool compress)
+{
+  if (!name || !name[0] || (len < 0) || (len && !data)) return false;
+  uint8_t *img = NULL;
+  if (compress) {
+    int zlen = ZBuildImage(reinterpret_cast<const uint8_t*>(data), len, &img);
+    if (zlen < 0) return false;
+    if (img) {
+      data = img;
+      len = zlen;
+    }
+  }
+  FASTROMFS_LOCK_EXCLUSIVE(this);
+  bool ok = fsIsMounted;
+  if (ok && (FindFileEntryByName(name) >= 0)) ok = RemoveFileEntry(name);
+  int idx = ok ? FindFreeFileEntry() : -1;
+  int count = max(1, (len + SECTORSIZE - 1) / SECTORSIZE);
+  int start = -1;
+  for (int s = FATCOPIES, run = 0; (idx >= 0) && (s < fs.md.sectors); s++) {
+    run = GetFAT(s) ? 0 : run + 1;
+    if (run == count) {
+      start = s - count + 1;
+      break;
+    }
+  }
+  ok = start >= 0;
+  const uint8_t *src = reinterpret_cast<const uint8_t*>(data);
+  uint32_t sector[SECTORSIZE / 4];
+  for (int i = 0; ok && (i < count); i++) {
+    int n = min(SECTORSIZE, len - i * SECTORSIZE);
+    memset(sector, 0, sizeof(sector));
+    if (n > 0) memcpy(sector, src + i * SECTORSIZE, n);
+    ok = ProgramSector(start + i, sector);
+    SetFAT(start + i, (i == count - 1) ? FATEOF : start + i + 1);
+  }
+  if (ok) {
+    SetFileEntryName(idx, name);
+    Entry(idx).fat = start;
+    if (img) Entry(idx).fat |= FATCOMPRESSED;
+    Entry(idx).len = len;
+    EntryChanged(idx);
+  } else if (start >= 0) {
+    for (int i = 0; i < count; i++) SetFAT(start + i, 0);
+  }
+  free(img);
+  return ok;
+}
+
+uint32_t FastROMFilesystem::SimulatedEraseCount(int sector)
+{
+  if ((sector < 0) || ((uint32_t)sector >= totalSectors)) return 0;
+  return simEraseCount[sector];
+}
+
+void FastROMFilesystem::SetSimulatedLatency(int readUsPerKB, int writeUs, int eraseUs)
+{
+  FASTROMFS_LOCK_EXCLUSIVE(this);
+#if FASTROMFS_WRITEBEHIND
+  // The worker reads these while it programs with the queue unlocked, so change them between sectors
+  pthread_mutex_lock(&wbMutex);
+  while (wbBusy) pthread_cond_wait(&wbCond, &wbMutex);
+#endif
+  simReadUsPerKB = readUsPerKB;
+  simWriteUs = writeUs;
+  simEraseUs = eraseUs;
+#if FASTROMFS_WRITEBEHIND
+  pthread_mutex_unlock(&wbMutex);
+#endif
 }
 #endif
 
 
-FastROMFSDir *FastROMFilesystem::opendir()
+FastROMFSDir *FastROMFilesystem::opendir(const char *prefix)
 {
+  FASTROMFS_LOCK_EXCLUSIVE(this);
   if (!fsIsMounted) return NULL;
-  struct FastROMFSDirent *de = (struct FastROMFSDirent *)malloc(sizeof(struct FastROMFSDirent));
-  if (!de) return NULL; // OOM
+  int slot = PoolAlloc(&direntUsed, FASTROMFS_MAX_OPEN_DIRS);
+  if (slot < 0) return NULL; // Too many open
+  struct FastROMFSDirent *de = &direntPool[slot];
   de->off = -1;
+  direntPrefix[slot][0] = 0;
+  if (prefix && strcmp(prefix, "/")) { // The flat root is everything
+    strncpy(direntPrefix[slot], prefix, NAMELEN);
+    direntPrefix[slot][NAMELEN] = 0;
+  }
   return (void*)de;
 }
 
 struct FastROMFSDirent *FastROMFilesystem::readdir(FastROMFSDir *dir)
 {
+  FASTROMFS_LOCK_SHARED(this);
   if (!fsIsMounted) return NULL;
   struct FastROMFSDirent *de = reinterpret_cast<struct FastROMFSDirent *>(dir);
+  const char *prefix = direntPrefix[de - direntPool];
+  int prefixLen = strlen(prefix);
   de->off++;
-  while (de->off < FILEENTRIES) {
+  while (de->off < FASTROMFS_MAX_FILES) {
     char name[NAMELEN];
-    GetFileEntryName(de->off, name);
-    if (name[0]) {
+    if (FileEntryInUse(de->off)) GetFileEntryName(de->off, name);
+    else name[0] = 0;
+    if (name[0] && !strncmp(name, prefix, prefixLen)) {
       strncpy(de->name, name, sizeof(name));
       de->name[sizeof(de->name) - 1] = 0;
-      de->len = GetFileEntryLen(de->off);
+      de->len = GetFileEntryDataLen(de->off);
       return de;
     }
     de->off++;
@@ -151,9 +545,10 @@ struct FastROMFSDirent *FastROMFilesystem::readdir(FastROMFSDir *dir)
 
 int FastROMFilesystem::closedir(FastROMFSDir *dir)
 {
+  FASTROMFS_LOCK_EXCLUSIVE(this);
   if (!fsIsMounted) return false;
   if (!dir) return -1;
-  free(dir);
+  PoolFree(&direntUsed, reinterpret_cast<struct FastROMFSDirent *>(dir) - direntPool);
   return 0;
 }
 
@@ -224,31 +619,99 @@ FastROMFilesystem::FastROMFilesystem(int sectors)
 
   lastFlashSector = -1; // Invalidate the 1-word cache
 #else
-  for (int i = 0; i < sectors; i++) flashErased[i] = false;
+  if (sectors > MAXFATENTRIES) sectors = MAXFATENTRIES;
+  flash = (uint8_t**)calloc(sectors, sizeof(uint8_t*)); // Starts out as a freshly erased chip
+  simEraseCount = (uint32_t*)calloc(sectors, sizeof(uint32_t));
   totalSectors = sectors;
+  simReadUsPerKB = 0;
+  simWriteUs = 0;
+  simEraseUs = 0;
 #endif
   fsIsDirty = false;
   fsIsMounted = false;
+  clones = false;
+  openFiles = NULL;
+  handleUsed = 0;
+  sharedUsed = 0;
+  bufferUsed = 0;
+  direntUsed = 0;
+#if FASTROMFS_LOWRAM
+  memset(nameHash, 0, sizeof(nameHash));
+  for (int i = 0; i < FASTROMFS_LOWRAM_NAMES; i++) pendingName[i].idx = -1;
+#endif
+  memset(erasedMap, 0, sizeof(erasedMap));
+  memset(&stats, 0, sizeof(stats));
+#ifdef ARDUINO
+  rngState = RANDOM_REG32 | 1; // Spread wear differently every boot
+#else
+  rngState = 1; // Reproducible runs unless the caller picks a seed
+#endif
+  budgetMaxUs = 0;
+  budgetMaxOps = 0;
+  budgetStart = 0;
+  budgetOps = 0;
+  yieldHook = NULL;
+  yieldArg = NULL;
+#if FASTROMFS_TRACE
+  traceHook = NULL;
+  traceArg = NULL;
+#endif
+#if FASTROMFS_INSTRUMENT
+  memset(latency, 0, sizeof(latency));
+  flashOpHook = NULL;
+  flashOpArg = NULL;
+#endif
+#if FASTROMFS_THREADSAFE
+  pthread_rwlock_init(&fsLock, NULL);
+#endif
+#if FASTROMFS_WRITEBEHIND
+  writeBehind = false;
+  wbHead = 0;
+  wbCount = 0;
+  wbBusy = false;
+  wbError = false;
+#ifndef ARDUINO
+  wbStop = false;
+  pthread_mutex_init(&wbMutex, NULL);
+  pthread_cond_init(&wbCond, NULL);
+#endif
+#endif
 }
 
 
 FastROMFilesystem::~FastROMFilesystem()
 {
   if (fsIsMounted) umount();
+#if FASTROMFS_WRITEBEHIND
+  setWriteBehind(false);
+#ifndef ARDUINO
+  pthread_cond_destroy(&wbCond);
+  pthread_mutex_destroy(&wbMutex);
+#endif
+#endif
+#if FASTROMFS_THREADSAFE
+  pthread_rwlock_destroy(&fsLock);
+#endif
+#ifndef ARDUINO
+  for (uint32_t i = 0; i < totalSectors; i++) SimErase(i);
+  free(flash);
+  free(simEraseCount);
+#endif
 }
 
 
 void FastROMFilesystem::DumpFS()
 {
+  FASTROMFS_LOCK_SHARED(this);
   DEBUG_FASTROMFS("fs.epoch = %ld; fs.sectors = %ld\n", (long)fs.md.epoch, (long)fs.md.sectors);
   
   DEBUG_FASTROMFS("%-32s - %-5s - %-5s\n", "name", "len", "fat");
-  for (int i = 0; i < FILEENTRIES; i++) {
-    if (fs.md.fileEntry[i].name[0]) {
-      char nm[NAMELEN+1];
-      memcpy(nm, fs.md.fileEntry[i].name, NAMELEN);
-      nm[NAMELEN] = 0;
-      DEBUG_FASTROMFS("%32s - %5d - %5d\n", nm, fs.md.fileEntry[i].len, fs.md.fileEntry[i].fat);
+  for (int i = 0; i < FASTROMFS_MAX_FILES; i++) {
+    char nm[NAMELEN+1];
+    GetFileEntryName(i, nm);
+    nm[NAMELEN] = 0;
+    if (nm[0]) {
+      DEBUG_FASTROMFS("%32s - %5d - %5d\n", nm, Entry(i).len, Entry(i).fat);
     }
   }
   for (int i = 0; i < fs.md.sectors; i++) {
@@ -267,14 +730,17 @@ void FastROMFilesystem::DumpSector(int sector)
     DEBUG_FASTROMFS("%s%02x ", (i % 32) == 0 ? "\n" : "", buff[i]);
   delete[] buff;
 #else
+  uint8_t buff[SECTORSIZE];
+  SimRead(sector, 0, buff, SECTORSIZE);
   for (int i = 0; i < SECTORSIZE; i++)
-    DEBUG_FASTROMFS("%s%02x ", (i % 32) == 0 ? "\n" : "", flash[sector][i]);
+    DEBUG_FASTROMFS("%s%02x ", (i % 32) == 0 ? "\n" : "", buff[i]);
 #endif
   DEBUG_FASTROMFS("\n");
 }
 
 int FastROMFilesystem::available()
 {
+  FASTROMFS_LOCK_SHARED(this);
   if (!fsIsMounted) return false;
   int avail = 0;
   for (int i = 0; i < fs.md.sectors; i++) {
@@ -285,12 +751,14 @@ int FastROMFilesystem::available()
 
 int FastROMFilesystem::fsize(const char *name)
 {
+  FASTROMFS_LOCK_SHARED(this);
   if (!fsIsMounted) return false;
   int idx = FindFileEntryByName(name);
   if (idx < 0) return -1;
-  return GetFileEntryLen(idx);
+  return GetFileEntryDataLen(idx);
 }
 
+#if !FASTROMFS_LOWRAM
 bool FastROMFilesystem::ValidateFAT()
 {
   if (fs.md.magic != FSMAGIC) return false;
@@ -301,21 +769,36 @@ bool FastROMFilesystem::ValidateFAT()
   if (savedCRC != calcCRC) return false; // Something baaaad here!
   return true;
 }
+#endif
 
 int FastROMFilesystem::FindFileEntryByName(const char *name)
 {
   if (!name) return -1;
 
+#if FASTROMFS_LOWRAM
+  uint8_t hash = NameHash(name);
+  for (int i = 0; i < FILEENTRIES; i++) {
+    if (nameHash[i] != hash) continue;
+    char nm[NAMELEN];
+    GetFileEntryName(i, nm);
+    if (!strncmp(nm, name, NAMELEN)) return i;
+  }
+#elif FASTROMFS_MAX_FILES > FILEENTRIES
+  for (int i = NameIndexHash(name) % (2 * FASTROMFS_MAX_FILES); nameIndex[i]; i = (i + 1) % (2 * FASTROMFS_MAX_FILES)) {
+    if (!strncmp(Entry(nameIndex[i] - 1).name, name, NAMELEN)) return nameIndex[i] - 1;
+  }
+#else
   for (int i = 0; i < FILEENTRIES; i++) {
     if (!strncmp(fs.md.fileEntry[i].name, name, sizeof(fs.md.fileEntry[i].name))) return i;
   }
+#endif
   return -1;
 }
 
 int FastROMFilesystem::FindFreeFileEntry()
 {
-  for (int i = 0; i < FILEENTRIES; i++) {
-    if (fs.md.fileEntry[i].name[0] == 0) return i;
+  for (int i = 0; i < FASTROMFS_MAX_FILES; i++) {
+    if (!FileEntryInUse(i)) return i;
   }
   return -1; // No space
 }
@@ -325,10 +808,9 @@ int FastROMFilesystem::CreateNewFileEntry(const char *name)
   int idx = FindFreeFileEntry();
   int sec = FindFreeSector();
   if ((idx < 0) || (sec < 0)) return -1;
-  strncpy(fs.md.fileEntry[idx].name, name, sizeof(fs.md.fileEntry[idx].name));
-  fs.md.fileEntry[idx].fat = sec;
-  fs.md.fileEntry[idx].len = 0;
-  fsIsDirty = true;
+  SetFileEntryName(idx, name);
+  Entry(idx).fat = sec;
+  Entry(idx).len = 0;
   SetFAT(sec, FATEOF);
   if (!FlushFAT()) return -1;
   return idx;
@@ -336,27 +818,159 @@ int FastROMFilesystem::CreateNewFileEntry(const char *name)
 
 bool FastROMFilesystem::unlink(const char *name)
 {
+  FASTROMFS_TRACE_CALL(this, FASTROMFS_TRACE_UNLINK, NULL, 0, TraceNameHash(name), 0);
+  FASTROMFS_LOCK_EXCLUSIVE(this);
   if (!fsIsMounted) return false;
+  return RemoveFileEntry(name);
+}
+
+bool FastROMFilesystem::truncate(const char *name, int len)
+{
+  FASTROMFS_TRACE_CALL(this, FASTROMFS_TRACE_TRUNCATE, NULL, 0, TraceNameHash(name), len);
+  FASTROMFS_LOCK_EXCLUSIVE(this);
+  if (!fsIsMounted || !name) return false;
+  int idx = FindFileEntryByName(name);
+  if ((idx < 0) || GetFileEntryCompressed(idx)) return false;
+  return TruncateFileEntry(idx, len);
+}
+
+// Cut the chain after the sector holding the new end and zero what's left of that sector past it, so a later write
+// beyond EOF still sees zeros like it would in a fresh sector.  Zeroing only clears bits, so it's programmed in place
+// and the surviving data is never copied.  One metadata flush however long the file was.
+bool FastROMFilesystem::TruncateFileEntry(int idx, int len)
+{
+  int head = GetFileEntryHead(idx);
+  if ((len < head) || (len > GetFileEntryLen(idx))) return false;
+  if (len == GetFileEntryLen(idx)) return true;
+  StartBudget();
+
+  int keep = max(1, (len - head + SECTORSIZE - 1) / SECTORSIZE); // Every file owns at least its first sector
+  if (UnshareChain(idx, keep) < 0) return false; // The new last sector gets relinked and zeroed, it can't be a clone's
+  int last = GetFileEntryFAT(idx);
+  for (int i = 1; i < keep; i++) last = GetFAT(last);
+  int lastOffset = head + (keep - 1) * SECTORSIZE;
+  int tail = len - lastOffset; // First byte of the last sector that's now past EOF
+  int sec = GetFAT(last);
+  SetFAT(last, FATEOF);
+  ReleaseChain(sec);
+
+  FastROMFileShared *sh = FindShared(idx);
+  bool buffered = false;
+  if (sh) {
+    if (sh->curWriteSectorOffset > lastOffset) { // Buffered sector was just freed, its contents are past EOF anyway
+      sh->dataDirty = false;
+      sh->cowPending = false;
+      sh->curWriteSector = -1;
+      sh->curWriteSectorOffset = -SECTORSIZE;
+      sh->prevWriteSector = -1;
+    } else if ((sh->curWriteSectorOffset == lastOffset) && sh->data) {
+      memset(sh->data + tail, 0, SECTORSIZE - tail);
+      if (sh->dataDirty) { // Flush will write it out, make sure it covers the zeros
+        buffered = true;
+        if (tail < sh->dirtyLo) sh->dirtyLo = tail;
+        sh->dirtyHi = SECTORSIZE;
+      }
+    }
+    sh->chainGen++;
+    sh->dataGen++;
+    // Appenders carry on from the new end, everyone else keeps their position like POSIX
+    for (int i = 0; i < FASTROMFS_MAX_OPEN_FILES; i++) {
+      if (!(handleUsed & (1UL << i))) continue;
+      FastROMFile *h = reinterpret_cast<FastROMFile*>(handlePool[i]);
+      if ((h->fileIdx == idx) && h->modeAppend && (h->writePos > len)) h->writePos = len;
+    }
+  }
+  // Commit the new length before zeroing past it, so losing power in between can't touch bytes the old length covers
+  SetFileEntryLen(idx, len);
+  if (!FlushFAT()) return false;
+  if (!buffered) {
+    uint32_t chunk[32];
+    for (int off = tail & ~(sizeof(chunk) - 1); off < SECTORSIZE; off += sizeof(chunk)) {
+      if (!ReadPartialSector(last, off, chunk, sizeof(chunk))) return false;
+      uint8_t *c = reinterpret_cast<uint8_t*>(chunk);
+      bool dirty = false;
+      for (int i = max(tail - off, 0); i < (int)sizeof(chunk); i++) {
+        if (c[i]) dirty = true;
+        c[i] = 0;
+      }
+      if (dirty && !ProgramPartialSector(last, off, chunk, sizeof(chunk))) return false;
+    }
+  }
+  return true;
+}
+
+int FastROMFilesystem::trim(const char *name, int off)
+{
+  FASTROMFS_TRACE_CALL(this, FASTROMFS_TRACE_TRIM, NULL, 0, TraceNameHash(name), off);
+  FASTROMFS_LOCK_EXCLUSIVE(this);
+  if (!fsIsMounted || !name) return -1;
+  int idx = FindFileEntryByName(name);
+  if ((idx < 0) || GetFileEntryCompressed(idx)) return -1;
+  return TrimFileEntry(idx, off);
+}
+
+// Unlink whole sectors from the front of the chain and remember how many in the entry, so every offset past them
+// keeps its meaning.  Costs one metadata flush and a FAT update per sector dropped, nothing per sector kept.
+int FastROMFilesystem::TrimFileEntry(int idx, int off)
+{
+  int head = GetFileEntryHead(idx);
+  int drop = (min(off, GetFileEntryLen(idx)) - head) / SECTORSIZE;
+  if (drop <= 0) return head;
+  StartBudget();
+
+  int old = GetFileEntryFAT(idx);
+  int first = old;
+  for (int i = 0; (i < drop) && (GetFAT(first) != FATEOF); i++) { // Never the last sector, appends go there
+    first = GetFAT(first);
+    head += SECTORSIZE;
+  }
+  Entry(idx).fat = ((head / SECTORSIZE) << FATHEADSHIFT) | first;
+  EntryChanged(idx);
+  ReleaseChain(old, first); // A clone may still want the front of the log
+
+  FastROMFileShared *sh = FindShared(idx);
+  if (sh) {
+    if (sh->curWriteSectorOffset < head) { // Buffered sector is gone, and so is anything unflushed in it
+      sh->dataDirty = false;
+      sh->cowPending = false;
+      sh->curWriteSector = -1;
+      sh->curWriteSectorOffset = -SECTORSIZE;
+      sh->prevWriteSector = -1;
+    } else if (sh->curWriteSector == first) {
+      sh->prevWriteSector = -1; // Now linked straight from the entry
+    }
+    sh->chainGen++;
+    sh->dataGen++;
+    // Anyone left behind the head picks up from it
+    for (int i = 0; i < FASTROMFS_MAX_OPEN_FILES; i++) {
+      if (!(handleUsed & (1UL << i))) continue;
+      FastROMFile *h = reinterpret_cast<FastROMFile*>(handlePool[i]);
+      if (h->fileIdx != idx) continue;
+      if (h->readPos < head) h->readPos = head;
+      if (h->writePos < head) h->writePos = head;
+    }
+  }
+  if (!FlushFAT()) return -1;
+  return head;
+}
+
+bool FastROMFilesystem::RemoveFileEntry(const char *name)
+{
   DEBUG_FASTROMFS("unlink('%s')\n", name);
   int idx = FindFileEntryByName(name);
   if (idx < 0) return false;
-  int sec = fs.md.fileEntry[idx].fat;
-  while (GetFAT(sec) != FATEOF) {
-    int nextSec = GetFAT(sec);
-    SetFAT(sec, 0);
-    sec = nextSec;
-  }
-  SetFAT(sec, 0);
-  fs.md.fileEntry[idx].name[0] = 0;
-  fs.md.fileEntry[idx].len = 0;
-  fs.md.fileEntry[idx].fat = 0;
+  int sec = GetFileEntryFAT(idx);
+  OrphanShared(idx);
+  SetFileEntryName(idx, "");
+  Entry(idx).len = 0;
+  Entry(idx).fat = 0;
+  ReleaseChain(sec); // Only once the entry's gone, so it doesn't count as a reference
   return FlushFAT();
 }
 
-int FastROMFilesystem::GetFAT(int idx)
+// 12-bit packed on-flash layout, two entries per three bytes
+int FastROMFilesystem::GetPackedFAT(int idx)
 {
-  if ((idx < 0) || (idx >= fs.md.sectors)) return -1;
-
   int bo = (idx / 2) * 3;
   int ret;
   if (idx & 1) {
@@ -371,10 +985,8 @@ int FastROMFilesystem::GetFAT(int idx)
   return ret;
 }
 
-void FastROMFilesystem::SetFAT(int idx, int val)
+void FastROMFilesystem::SetPackedFAT(int idx, int val)
 {
-  if ((idx < 0) || (idx >= fs.md.sectors)) return;
-
   int bo = (idx / 2) * 3;
   if (idx & 1) {
     fs.md.fat[bo + 1] &= ~0x0f;
@@ -385,175 +997,1027 @@ void FastROMFilesystem::SetFAT(int idx, int val)
     fs.md.fat[bo + 1] |= (val >> 4) & 0xf0;
     fs.md.fat[bo] = val & 0xff;
   }
+}
+
+#if FASTROMFS_UNPACKEDFAT
+void FastROMFilesystem::PackFAT()
+{
+  for (int i = 0; i < fs.md.sectors; i++) SetPackedFAT(i, fat16[i]);
+}
+
+void FastROMFilesystem::UnpackFAT()
+{
+  memset(fat16, 0, sizeof(fat16));
+  for (int i = 0; i < fs.md.sectors; i++) fat16[i] = GetPackedFAT(i);
+}
+#else
+int FastROMFilesystem::GetFAT(int idx)
+{
+  if ((idx < 0) || (idx >= fs.md.sectors)) return -1;
+  return GetPackedFAT(idx);
+}
 
+void FastROMFilesystem::SetFAT(int idx, int val)
+{
+  if ((idx < 0) || (idx >= fs.md.sectors)) return;
+  SetPackedFAT(idx, val);
   fsIsDirty = true;
 }
+#endif
 
 int FastROMFilesystem::FindFreeSector()
 {
-  int a = rand() % fs.md.sectors;
-  for (int i = 0; (i < fs.md.sectors) && (GetFAT(a) != 0);  i++, a = (a + 1) % fs.md.sectors) {
-    /*empty*/
+  int start = Random() % fs.md.sectors;
+  // Prefer something out of the pre-erased pool so the caller only has to program it.  Sectors freed while still in
+  // the write-behind queue wait, or their stale copy would land on top of whatever the new owner erased and wrote.
+  int a = start;
+  for (int i = 0; i < fs.md.sectors; i++, a = (a + 1) % fs.md.sectors) {
+    if ((GetFAT(a) == 0) && IsErased(a) && !IsQueued(a)) return a;
   }
-  if (GetFAT(a) != 0) return -1;
-  return a;
+  int queued = -1;
+  a = start;
+  for (int i = 0; i < fs.md.sectors; i++, a = (a + 1) % fs.md.sectors) {
+    if (GetFAT(a) != 0) continue;
+    if (!IsQueued(a)) return a;
+    queued = a;
+  }
+  if (queued >= 0) WaitUnqueued(queued); // Nothing else left, let the old copy hit flash first
+  return queued;
 }
 
-
-bool FastROMFilesystem::EraseSector(int sector)
+// Only trusts flash that reads back all 1s, bails at the first programmed word
+bool FastROMFilesystem::IsSectorBlank(int sector)
 {
-  if ((sector < 0) || (sector >= fs.md.sectors)) return false;
-
-  DEBUG_FASTROMFS("EraseSector(%d)\n", sector);
-#ifdef ARDUINO
-  // If we're messing with this sector, invalidate any cached data corresponding to it
-  if (sector == lastFlashSector) lastFlashSector = -1;
-
-  return ESP.flashEraseSector(baseSector + sector);
-#else
-  memset(flash[sector], 0, SECTORSIZE);
-  flashErased[sector] = true;
+  uint32_t buff[64];
+  for (int off = 0; off < SECTORSIZE; off += sizeof(buff)) {
+    if (!ReadPartialSector(sector, off, buff, sizeof(buff))) return false;
+    for (size_t i = 0; i < sizeof(buff) / sizeof(buff[0]); i++) {
+      if (buff[i] != 0xffffffff) return false;
+    }
+  }
   return true;
-#endif
 }
 
-bool FastROMFilesystem::WriteSector(int sector, const void *data)
+int FastROMFilesystem::PreErasePoolDepth()
 {
-  DEBUG_FASTROMFS("WriteSector(%d, data)\n", sector);
-
-  if ((sector < 0) || (sector >= fs.md.sectors) || !data) return false;
-  if ((const uintptr_t)data % 4) return false; // Need to have 32-bit aligned inputs!
-
-#ifdef ARDUINO
-  // If we're messing with this sector, invalidate any cached data corresponding to it
-  if (sector == lastFlashSector) lastFlashSector = -1;
-
-  return ESP.flashWrite(baseAddr + sector * FLASH_SECTOR_SIZE, (uint32_t*)data, FLASH_SECTOR_SIZE);
-#else
-  if (!flashErased[sector]) {
-    DEBUG_FASTROMFS("!!!ERROR, sector not erased!!!\n");
-    return false;
+  int depth = 0;
+  for (int i = 0; i < fs.md.sectors; i++) {
+    if ((GetFAT(i) == 0) && IsErased(i)) depth++;
   }
-  memcpy(flash[sector], data, SECTORSIZE);
-  flashErased[sector] = false;
-  return true;
+  return depth;
+}
+
+// Top up the pool of erased free sectors.  Call when there's nothing better to do.
+bool FastROMFilesystem::idle(int maxErases)
+{
+  FASTROMFS_TRACE_CALL(this, FASTROMFS_TRACE_IDLE, NULL, 0, maxErases, 0);
+  FASTROMFS_LOCK_EXCLUSIVE(this);
+  if (!fsIsMounted) return false;
+#if FASTROMFS_WRITEBEHIND
+  if (writeBehind && pump()) return true; // Flash is busy with real work
 #endif
+  int depth = PreErasePoolDepth();
+  int a = Random() % fs.md.sectors;
+  bool flushed = false;
+  for (int i = 0; (i < fs.md.sectors) && (depth < FASTROMFS_PREERASE_DEPTH) && (maxErases > 0); i++, a = (a + 1) % fs.md.sectors) {
+    if ((GetFAT(a) != 0) || IsErased(a)) continue;
+    // Free in RAM has to mean free on flash, a copied-on-write original stays live until the metadata says otherwise
+    if (!flushed && !FlushFAT()) return false;
+    flushed = true;
+    if (!EraseSector(a)) return false;
+    stats.preErases++;
+    depth++;
+    maxErases--;
+  }
+  return depth < FASTROMFS_PREERASE_DEPTH;
 }
 
+#define BITSET(map, n) ((map)[(n) >> 3] |= 1 << ((n) & 7))
+#define BITTEST(map, n) ((map)[(n) >> 3] & (1 << ((n) & 7)))
 
-bool FastROMFilesystem::ReadSector(int sector, void *data)
+// Copy one sector somewhere else and relink whatever pointed at it.  prev < 0 means it's the file's first sector, or
+// the directory chain's with fileIdx < 0 too.
+bool FastROMFilesystem::MoveSector(int src, int dst, int fileIdx, int prev, void *buff)
 {
-  if ((sector < 0) || (sector >= fs.md.sectors) || !data) return false;
-  if ((const uintptr_t)data % 4) return false; // Need to have 32-bit aligned inputs!
-
-#ifdef ARDUINO
-  return ESP.flashRead(baseAddr + sector * FLASH_SECTOR_SIZE, (uint32_t*)data, FLASH_SECTOR_SIZE);
-#else
-  memcpy(data, flash[sector], SECTORSIZE);
+  if (!ReadSector(src, buff)) return false;
+  if (!ProgramSector(dst, buff)) return false;
+  SetFAT(dst, GetFAT(src));
+  if (prev >= 0) SetFAT(prev, dst);
+  else if (fileIdx >= 0) SetFileEntryFAT(fileIdx, dst);
+  else fs.md.dirSector = dst; // Lands with the rest of the metadata in the next flush
+  SetFAT(src, 0);
+  stats.defragMoves++;
   return true;
-#endif
 }
 
-bool FastROMFilesystem::ReadPartialSector(int sector, int offset, void *data, int len)
+// Who points at this sector, a file entry (prev = -1), the metadata's directory chain (both -1) or another sector
+bool FastROMFilesystem::FindLink(int sector, int *fileIdx, int *prev)
 {
-  if ((sector < 0) || (sector >= fs.md.sectors) || !data || (len < 0) || (offset < 0) || (offset + len > SECTORSIZE)) return false;
-
-  // Easy case, everything is aligned and we can just do it...
-  if ( ((offset % 4) == 0) && ((len % 4) == 0) && (((const uintptr_t)data % 4) == 0) ) {
-#ifdef ARDUINO
-    ESP.flashRead(baseAddr + sector * FLASH_SECTOR_SIZE + offset, (uint32_t*)data, len);
-#else
-    memcpy(data, &flash[sector][offset], len);
-#endif
+  if ((sector >= FATCOPIES) && (fs.md.dirSector == sector)) {
+    *fileIdx = -1;
+    *prev = -1;
     return true;
   }
-
-//  memset(data, 0, len); // Clear buffer just for debugging sanity
-
-  // We're gonna get wordy here for sanity's sake.  This align and shifting is a brain twister.
-  uint8_t *destStart = reinterpret_cast<uint8_t*>(data);
-  uint8_t *destEnd = destStart + len;
-  uint8_t *destStartAligned = (uint8_t*) ((uintptr_t)(destStart + 3) & (uintptr_t) ~3);
-  uint8_t *destEndAligned = (uint8_t*) ((uintptr_t)(destEnd) & (uintptr_t) ~3);
-  int destLen = destEnd - destStart;
-  int destLenAligned = destEndAligned - destStartAligned;
-  int srcStart = offset;
-  int srcEnd = srcStart + len;
-  int srcLen = len;
-  int srcStartAligned = (srcStart) & ~3;
-  int srcEndAligned = (srcEnd + 3) & ~3;
-  int srcLenAligned = srcEndAligned - srcStartAligned;
-  int shiftLeftBytes = 0;
-  int bytesToShift = 0;
-  if (destLenAligned > 0) {
-    // Read the flash aligned into the ram aligned
-#ifdef ARDUINO
-    ESP.flashRead(baseAddr + sector * FLASH_SECTOR_SIZE + srcStartAligned, (uint32_t*)destStartAligned, destLenAligned);
-#else
-    memcpy(destStartAligned, &flash[sector][srcStartAligned], destLenAligned);
-#endif
-    // Move it to the beginning of the buffer
-    shiftLeftBytes = (destStartAligned - destStart) /* account for ram shift */ + (srcStart - srcStartAligned); /* flash shift */
-    bytesToShift = destLenAligned - (srcStart - srcStartAligned); // the alignment flash bytes are thrown away, all else kept
-    memmove(destStart, destStart + shiftLeftBytes, bytesToShift); // memmove because these overlap
-    // Adjust the pointers to indicate what we've completed so far, again for sanity's sake.
-    destStart += bytesToShift; // We wrote this many bytes
-    destLen -= bytesToShift;
-    memset(destStart, 0, destLen); // Clear for easier debug
-    srcStart += bytesToShift;
-    srcStartAligned = (srcStart) & ~3;
-    srcLen -= bytesToShift;
-    srcLenAligned = srcEndAligned - srcStartAligned;
-  }
-  // Now let's do the same thing to a stack buffer and memcpy to the final bit of ram
-  uint8_t buff[64 + 8]; // bounce buffer, need to account for shift of RAM and flash
-  uint8_t *alignBuff = (uint8_t*)((uintptr_t)(buff + 3) & (uintptr_t) ~3); // 32bit aligned pointer into that buffer
-  // Read remainder of flash to the alignment bounce buffer.
-#ifdef ARDUINO
-  // Check if we have cached this data (only valid if it fits in 1 32-bit word)
-  if ( (lastFlashSector == sector) && (lastFlashSectorOffset == srcStartAligned) && (srcLenAligned == 4) ) {
-      *(uint32_t*)alignBuff = lastFlashSectorData;
-  } else {
-    // Nope, read it out
-    ESP.flashRead(baseAddr + sector * FLASH_SECTOR_SIZE + srcStartAligned, (uint32_t*)alignBuff, srcLenAligned);
-  
-    // Store the read out data for potential use by subsequent ReadPartials if it was a single 32-bit read
-    if (srcLenAligned == 4) {
-      lastFlashSector = sector;
-      lastFlashSectorOffset = srcStartAligned;
-      lastFlashSectorData = *(uint32_t*)alignBuff;
+  for (int i = 0; i < FASTROMFS_MAX_FILES; i++) {
+    if (FileEntryInUse(i) && (GetFileEntryFAT(i) == sector)) {
+      *fileIdx = i;
+      *prev = -1;
+      return true;
     }
   }
-#else
-  memcpy(alignBuff, &flash[sector][srcStartAligned], srcLenAligned);
-#endif
-  // Move it to destination buffer
-  memcpy(destStart, alignBuff + (srcStart - srcStartAligned), srcLen);
-  // Eh voila...easy peasy, lemon squeezy
-#ifndef ARDUINO
-  void *simpledata = (void*)malloc(len);
-  memcpy(simpledata, &flash[sector][offset], len);
-  if (memcmp(simpledata, data, len))
-    DEBUG_FASTROMFS("ERROR!  Misaligned read data doesn't match correct\n");
-  free(simpledata);
-#endif
+  for (int i = FATCOPIES; i < fs.md.sectors; i++) {
+    if (GetFAT(i) == sector) {
+      *fileIdx = -1;
+      *prev = i;
+      return true;
+    }
+  }
+  return false;
+}
+
+// Sector to sector through a small stack buffer, so it works while the caller's 4KB buffer holds something else
+bool FastROMFilesystem::CopySector(int src, int dst)
+{
+  if (!EraseSector(dst)) return false;
+  uint32_t chunk[64];
+  for (int off = 0; off < SECTORSIZE; off += sizeof(chunk)) {
+    if (!ReadPartialSector(src, off, chunk, sizeof(chunk))) return false;
+    bool blank = true;
+    for (size_t i = 0; blank && (i < sizeof(chunk) / 4); i++) blank = (chunk[i] == 0xffffffff);
+    if (!blank && !ProgramPartialSector(dst, off, chunk, sizeof(chunk))) return false;
+  }
   return true;
 }
 
-bool FastROMFilesystem::mkfs()
+// Mark every sector that more than one file entry or FAT link points at.  Returns whether there were any.
+bool FastROMFilesystem::FindSharedSectors(uint8_t *shared)
 {
-  if (fsIsMounted) return false;
-  memset(&fs, 0, sizeof(fs));
+  uint8_t once[MAXFATENTRIES / 8];
+  memset(once, 0, sizeof(once));
+  memset(shared, 0, MAXFATENTRIES / 8);
+  bool any = false;
+  for (int i = 0; i < FASTROMFS_MAX_FILES + fs.md.sectors; i++) {
+    int sec;
+    if (i < FASTROMFS_MAX_FILES) sec = FileEntryInUse(i) ? GetFileEntryFAT(i) : 0;
+    else sec = (i - FASTROMFS_MAX_FILES < FATCOPIES) ? 0 : GetFAT(i - FASTROMFS_MAX_FILES);
+    if ((sec <= 0) || (sec >= fs.md.sectors)) continue;
+    if (BITTEST(once, sec)) {
+      BITSET(shared, sec);
+      any = true;
+    }
+    BITSET(once, sec);
+  }
+  return any;
+}
+
+// How many file entries and FAT links point at this sector
+int FastROMFilesystem::SectorRefs(int sector)
+{
+  int refs = 0;
+  for (int i = 0; i < FASTROMFS_MAX_FILES; i++) {
+    if (FileEntryInUse(i) && (GetFileEntryFAT(i) == sector)) refs++;
+  }
+  for (int i = FATCOPIES; i < fs.md.sectors; i++) {
+    if (GetFAT(i) == sector) refs++;
+  }
+  return refs;
+}
+
+// The caller just unlinked sector.  Free it and what follows, up to stop (-1 = the end), for as long as nothing else
+// points there.  Without clones nothing ever does.
+void FastROMFilesystem::ReleaseChain(int sector, int stop)
+{
+  while ((sector > 0) && (sector < fs.md.sectors) && (sector != stop) && (!clones || !SectorRefs(sector))) {
+    int next = GetFAT(sector);
+    SetFAT(sector, 0);
+    sector = next;
+  }
+}
+
+// With next-links in the FAT, once a chain reaches a shared sector everything after it is shared too.  Give file idx
+// its own copies of whatever's shared among its first n sectors (all of them if n is past the end), so the links up
+// to the nth can be changed without touching a clone.  Returns whether the nth sector itself is still shared, -1 on
+// error.  Its copy is left to the copy-on-write in FlushData(), which has to rewrite it anyway.
+int FastROMFilesystem::UnshareChain(int idx, int n)
+{
+  if (!clones) return 0;
+  uint8_t shared[MAXFATENTRIES / 8];
+  if (!FindSharedSectors(shared)) {
+    clones = false; // The last clone's diverged or gone
+    return 0;
+  }
+  FastROMFileShared *sh = FindShared(idx);
+  bool inShared = false;
+  int prev = -1;
+  int sec = GetFileEntryFAT(idx);
+  for (int i = 0; (i < fs.md.sectors) && (sec > 0) && (sec < fs.md.sectors); i++) {
+    if (BITTEST(shared, sec)) inShared = true;
+    if (i == n) return inShared ? 1 : 0;
+    if (inShared) {
+      int dst = FindFreeSector();
+      if ((dst < 0) || !CopySector(sec, dst)) return -1;
+      SetFAT(dst, GetFAT(sec));
+      if (prev < 0) SetFileEntryFAT(idx, dst);
+      else SetFAT(prev, dst);
+      if (sh) {
+        if (sh->curWriteSector == sec) sh->curWriteSector = dst;
+        if (sh->prevWriteSector == sec) sh->prevWriteSector = dst;
+        sh->chainGen++;
+      }
+      sec = dst;
+    }
+    prev = sec;
+    sec = GetFAT(sec);
+  }
+  return 0;
+}
+
+#if FASTROMFS_MAX_FILES > FILEENTRIES
+// Pull the directory chain into RAM.  Sectors past what this build can hold stay linked and untouched.
+bool FastROMFilesystem::LoadDirChain()
+{
+  memset(dirEntry, 0, sizeof(dirEntry));
+  dirDirty = 0;
+  dirChainLen = 0;
+  for (int sec = fs.md.dirSector; (sec >= FATCOPIES) && (sec < fs.md.sectors) && (dirChainLen < (int)DIRSECTORS); sec = GetFAT(sec)) {
+    if (!ReadSector(sec, &dirEntry[dirChainLen * DIRENTRIES])) return false;
+    dirChainLen++;
+  }
+  NameIndexRebuild();
+  return true;
+}
+
+// Copy-on-write each changed chain sector ahead of the metadata that links it in, growing the chain as needed.  The
+// replaced sectors are only freed once every new one has been allocated, so nothing the flash metadata still points
+// at gets reused before the flush lands.
+bool FastROMFilesystem::WriteDirChain()
+{
+  int len = dirChainLen;
+  for (int k = 0; k < (int)DIRSECTORS; k++) {
+    if (dirDirty & (1UL << k)) len = max(len, k + 1);
+  }
+  int replaced[DIRSECTORS];
+  int prev = -1;
+  int sec = fs.md.dirSector;
+  for (int k = 0; k < len; k++) {
+    bool have = k < dirChainLen;
+    int next = have ? GetFAT(sec) : FATEOF;
+    replaced[k] = -1;
+    if (!have || (dirDirty & (1UL << k))) {
+      int dst = FindFreeSector();
+      if (dst < 0) return false;
+      if (!EraseSector(dst) || !WriteSector(dst, &dirEntry[k * DIRENTRIES])) return false;
+      SetFAT(dst, next);
+      if (prev < 0) fs.md.dirSector = dst;
+      else SetFAT(prev, dst);
+      if (have) replaced[k] = sec;
+      sec = dst;
+    }
+    prev = sec;
+    sec = next;
+  }
+  for (int k = 0; k < len; k++) {
+    if (replaced[k] >= 0) SetFAT(replaced[k], 0);
+  }
+  dirChainLen = len;
+  dirDirty = 0;
+  return true;
+}
+
+uint32_t FastROMFilesystem::NameIndexHash(const char *name)
+{
+  uint32_t h = 2166136261UL;
+  for (int i = 0; (i < NAMELEN) && name[i]; i++) h = (h ^ (uint8_t)name[i]) * 16777619UL;
+  return h;
+}
+
+#define NAMEINDEXSIZE (2 * FASTROMFS_MAX_FILES)
+
+void FastROMFilesystem::NameIndexAdd(int idx)
+{
+  int i = NameIndexHash(Entry(idx).name) % NAMEINDEXSIZE;
+  while (nameIndex[i]) i = (i + 1) % NAMEINDEXSIZE;
+  nameIndex[i] = idx + 1;
+}
+
+// Backward-shift delete, the probe chains stay unbroken without tombstones
+void FastROMFilesystem::NameIndexRemove(int idx)
+{
+  int hole = NameIndexHash(Entry(idx).name) % NAMEINDEXSIZE;
+  for (int n = 0; nameIndex[hole] != idx + 1; n++, hole = (hole + 1) % NAMEINDEXSIZE) {
+    if (!nameIndex[hole] || (n == NAMEINDEXSIZE)) return; // Not indexed
+  }
+  for (int i = (hole + 1) % NAMEINDEXSIZE; nameIndex[i]; i = (i + 1) % NAMEINDEXSIZE) {
+    int home = NameIndexHash(Entry(nameIndex[i] - 1).name) % NAMEINDEXSIZE;
+    if ((i - home + NAMEINDEXSIZE) % NAMEINDEXSIZE >= (i - hole + NAMEINDEXSIZE) % NAMEINDEXSIZE) {
+      nameIndex[hole] = nameIndex[i];
+      hole = i;
+    }
+  }
+  nameIndex[hole] = 0;
+}
+
+void FastROMFilesystem::NameIndexRebuild()
+{
+  memset(nameIndex, 0, sizeof(nameIndex));
+  for (int i = 0; i < FASTROMFS_MAX_FILES; i++) {
+    if (FileEntryInUse(i)) NameIndexAdd(i);
+  }
+}
+#endif
+
+// Files get packed one after another in directory order, starting right after the metadata copies, so a sector that's
+// reached its slot stays there until something earlier in the directory changes size.  A slot held by another file's
+// sector is emptied first and filled on a later call.  Crash safety comes from the epoch-ordered metadata: every copy
+// lands on a sector the newest metadata on flash calls free, and the sources aren't reused until the flush at the end,
+// so losing power anywhere leaves either the old or the new layout intact.
+bool FastROMFilesystem::defrag(int maxMoves)
+{
+  FASTROMFS_LOCK_EXCLUSIVE(this);
+  if (!fsIsMounted || (maxMoves <= 0)) return false;
+  if (!FlushFAT()) return false; // Free in RAM has to mean free on flash before anything gets copied over it
+  int b = PoolAlloc(&bufferUsed, FASTROMFS_MAX_WRITE_BUFFERS);
+  if (b < 0) return true; // Every write buffer is busy, try again later
+  StartBudget();
+
+  uint8_t pinned[MAXFATENTRIES / 8]; // Sectors of open files
+  uint8_t freed[MAXFATENTRIES / 8]; // Moved away from this call, but still live as far as the flash is concerned
+  memset(pinned, 0, sizeof(pinned));
+  memset(freed, 0, sizeof(freed));
+  for (FastROMFileShared *sh = openFiles; sh; sh = sh->next) {
+    if (sh->fileIdx < 0) continue;
+    int sec = GetFileEntryFAT(sh->fileIdx);
+    for (int n = 0; (n < fs.md.sectors) && (sec > 0) && (sec < fs.md.sectors); n++, sec = GetFAT(sec)) BITSET(pinned, sec);
+  }
+  uint8_t shared[MAXFATENTRIES / 8];
+  if (clones && FindSharedSectors(shared)) {
+    // MoveSector() only relinks one predecessor, so shared sectors and the chains after them stay put
+    for (int idx = 0; idx < FASTROMFS_MAX_FILES; idx++) {
+      if (!FileEntryInUse(idx)) continue;
+      bool inShared = false;
+      int sec = GetFileEntryFAT(idx);
+      for (int n = 0; (n < fs.md.sectors) && (sec > 0) && (sec < fs.md.sectors); n++, sec = GetFAT(sec)) {
+        if (BITTEST(shared, sec)) inShared = true;
+        if (inShared) BITSET(pinned, sec);
+      }
+    }
+  }
+  int used = 0; // Everything below FATCOPIES + used is somebody's slot
+  for (int i = FATCOPIES; i < fs.md.sectors; i++) if (GetFAT(i)) used++;
+
+  bool ok = true;
+  bool more = false;
+  int moves = 0;
+  int slot = FATCOPIES; // Where the next sector in directory order belongs
+  for (int idx = 0; ok && (idx < FASTROMFS_MAX_FILES); idx++) {
+    if (!FileEntryInUse(idx)) continue;
+    int prev = -1;
+    int sec = GetFileEntryFAT(idx);
+    for (int n = 0; (n < fs.md.sectors) && (sec > 0) && (sec < fs.md.sectors); n++, slot++) {
+      if ((sec != slot) && !BITTEST(pinned, sec) && (slot < fs.md.sectors) && !BITTEST(pinned, slot)) {
+        if (BITTEST(freed, slot)) {
+          more = true; // Emptied this call, can only be reused after the flush
+        } else if (moves >= maxMoves) {
+          more = true;
+        } else if (!GetFAT(slot)) {
+          ok = MoveSector(sec, slot, idx, prev, bufferPool[b]);
+          BITSET(freed, sec);
+          sec = slot;
+          moves++;
+        } else {
+          // Someone else is in the way, send them somewhere out of the packed area (or at least somewhere free)
+          int to = -1;
+          for (int i = fs.md.sectors - 1; (i >= FATCOPIES) && (to < 0); i--) {
+            if (!GetFAT(i) && !BITTEST(freed, i) && (i >= FATCOPIES + used)) to = i;
+          }
+          for (int i = fs.md.sectors - 1; (i >= FATCOPIES) && (to < 0); i--) {
+            if (!GetFAT(i) && !BITTEST(freed, i)) to = i;
+          }
+          int owner, ownerPrev;
+          if ((to >= 0) && FindLink(slot, &owner, &ownerPrev)) {
+            ok = MoveSector(slot, to, owner, ownerPrev, bufferPool[b]);
+            BITSET(freed, slot);
+            moves++;
+            more = true;
+          }
+        }
+      }
+      if (!ok) break;
+      int next = GetFAT(sec); // Re-read, the sector may have moved or its successor been evicted
+      if (next == FATEOF) {
+        slot++;
+        break;
+      }
+      prev = sec;
+      sec = next;
+    }
+  }
+  PoolFree(&bufferUsed, b);
+  if (!FlushFAT()) return false;
+  DEBUG_FASTROMFS("defrag(): %d moves, %s\n", moves, more ? "more to do" : "done");
+  return ok && more;
+}
+
+int FastROMFilesystem::fragments()
+{
+  FASTROMFS_LOCK_SHARED(this);
+  if (!fsIsMounted) return 0;
+  int frags = 0;
+  for (int idx = 0; idx < FASTROMFS_MAX_FILES; idx++) {
+    if (!FileEntryInUse(idx)) continue;
+    int sec = GetFileEntryFAT(idx);
+    for (int n = 0; (n < fs.md.sectors) && (sec > 0) && (sec < fs.md.sectors); n++) {
+      int next = GetFAT(sec);
+      if (next == FATEOF) break;
+      if (next != sec + 1) frags++;
+      sec = next;
+    }
+  }
+  return frags;
+}
+
+void FastROMFilesystem::setRandomSeed(uint32_t seed)
+{
+  FASTROMFS_LOCK_EXCLUSIVE(this);
+  rngState = seed ? seed : 0x9e3779b9; // xorshift never leaves 0
+}
+
+#if FASTROMFS_TRACE
+void FastROMFilesystem::setTraceHook(FastROMFSTraceHook hook, void *arg)
+{
+  FASTROMFS_LOCK_EXCLUSIVE(this);
+  traceHook = hook;
+  traceArg = arg;
+}
+
+void FastROMFilesystem::Trace(uint8_t op, const FastROMFile *f, int arg, int32_t a, int32_t b)
+{
+  if (!traceHook) return;
+  FastROMFSTraceRecord rec;
+  rec.op = op;
+  rec.handle = f ? (reinterpret_cast<const uint8_t*>(f) - reinterpret_cast<const uint8_t*>(handlePool)) / sizeof(handlePool[0]) : 0xff;
+  rec.arg = arg;
+  rec.time = Micros();
+  rec.a = a;
+  rec.b = b;
+  traceHook(&rec, traceArg);
+}
+
+// Files are told apart by a hash so traces don't carry customer file names
+int32_t FastROMFilesystem::TraceNameHash(const char *name)
+{
+  uint32_t h = 2166136261UL;
+  for (int i = 0; name && (i < NAMELEN) && name[i]; i++) h = (h ^ (uint8_t)name[i]) * 16777619UL;
+  return h;
+}
+
+void FastROMFile::Trace(uint8_t op, int arg, int32_t a, int32_t b)
+{
+  fs->Trace(op, this, arg, a, b);
+}
+#endif
+
+uint32_t FastROMFilesystem::Micros()
+{
+#ifdef ARDUINO
+  return micros();
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+}
+
+void FastROMFilesystem::setWriteBudget(uint32_t maxUs, int maxFlashOps)
+{
+  FASTROMFS_LOCK_EXCLUSIVE(this);
+  budgetMaxUs = maxUs;
+  budgetMaxOps = max(maxFlashOps, 0);
+}
+
+void FastROMFilesystem::setYieldHook(FastROMFSYieldHook hook, void *arg)
+{
+  FASTROMFS_LOCK_EXCLUSIVE(this);
+  yieldHook = hook;
+  yieldArg = arg;
+}
+
+bool FastROMFilesystem::BudgetSpent()
+{
+  if (budgetMaxOps && (budgetOps >= budgetMaxOps)) return true;
+  return budgetMaxUs && ((uint32_t)(Micros() - budgetStart) >= budgetMaxUs);
+}
+
+// Called just before each erase or program.  Yields first if the ops so far used up the budget, then charges this one.
+void FastROMFilesystem::YieldPoint()
+{
+  if (!budgetMaxUs && !budgetMaxOps) return;
+#if FASTROMFS_WRITEBEHIND && !defined(ARDUINO)
+  if (writeBehind && pthread_equal(pthread_self(), wbThread)) return; // Background work isn't any caller's time
+#endif
+  if (yieldHook && BudgetSpent()) {
+    stats.budgetYields++;
+    yieldHook(yieldArg);
+    StartBudget();
+  }
+  budgetOps++;
+}
+
+#if FASTROMFS_INSTRUMENT
+void FastROMFilesystem::RecordLatency(int op, int sector, uint32_t us)
+{
+  FastROMFSLatency *l = &latency[op];
+  int b = 0;
+  while ((b < FASTROMFS_LATENCY_BUCKETS - 1) && (us >= (2UL << b))) b++;
+  FASTROMFS_ATOMIC_ADD(l->bucket[b], 1);
+  FASTROMFS_ATOMIC_ADD(l->count, 1);
+  FASTROMFS_ATOMIC_ADD(l->totalUs, us);
+#if FASTROMFS_THREADSAFE || (FASTROMFS_WRITEBEHIND && !defined(ARDUINO))
+  uint32_t m = __atomic_load_n(&l->maxUs, __ATOMIC_RELAXED);
+  while ((us > m) && !__atomic_compare_exchange_n(&l->maxUs, &m, us, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) { /* retry */ }
+#else
+  if (us > l->maxUs) l->maxUs = us;
+#endif
+  if (flashOpHook && (op <= FASTROMFS_OP_FLUSHFAT)) flashOpHook(op, sector, us, flashOpArg);
+}
+
+bool FastROMFilesystem::getLatency(int op, FastROMFSLatency *lat)
+{
+  if ((op < 0) || (op >= FASTROMFS_OPS) || !lat) return false;
+  *lat = latency[op];
+  // Percentiles are only known to bucket resolution, so report the bucket's upper edge
+  lat->p50Us = 0;
+  lat->p99Us = 0;
+  uint32_t seen = 0;
+  for (int b = 0; b < FASTROMFS_LATENCY_BUCKETS; b++) {
+    if (!lat->bucket[b]) continue;
+    seen += lat->bucket[b];
+    uint32_t edge = min((uint32_t)((2UL << b) - 1), lat->maxUs);
+    if (!lat->p50Us && (seen * 100ULL >= lat->count * 50ULL)) lat->p50Us = edge;
+    if (!lat->p99Us && (seen * 100ULL >= lat->count * 99ULL)) lat->p99Us = edge;
+  }
+  return true;
+}
+
+void FastROMFilesystem::resetLatency()
+{
+  FASTROMFS_LOCK_EXCLUSIVE(this);
+  memset(latency, 0, sizeof(latency));
+}
+
+void FastROMFilesystem::setFlashOpHook(FastROMFSFlashOpHook hook, void *arg)
+{
+  FASTROMFS_LOCK_EXCLUSIVE(this);
+  flashOpHook = hook;
+  flashOpArg = arg;
+}
+#endif
+
+void FastROMFilesystem::getStats(FastROMFSStats *st)
+{
+  FASTROMFS_LOCK_SHARED(this);
+#if FASTROMFS_THREADSAFE || (FASTROMFS_WRITEBEHIND && !defined(ARDUINO))
+  // The write-behind thread and other readers keep counting while we copy, every field is a uint32_t
+  const uint32_t *src = reinterpret_cast<const uint32_t*>(&stats);
+  uint32_t *dst = reinterpret_cast<uint32_t*>(st);
+  for (size_t i = 0; i < sizeof(stats) / 4; i++) dst[i] = __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+#else
+  *st = stats;
+#endif
+  st->preErasePool = fsIsMounted ? PreErasePoolDepth() : 0;
+}
+
+void FastROMFilesystem::resetStats()
+{
+  FASTROMFS_LOCK_EXCLUSIVE(this);
+#if FASTROMFS_THREADSAFE || (FASTROMFS_WRITEBEHIND && !defined(ARDUINO))
+  uint32_t *dst = reinterpret_cast<uint32_t*>(&stats);
+  for (size_t i = 0; i < sizeof(stats) / 4; i++) __atomic_store_n(&dst[i], 0, __ATOMIC_RELAXED);
+#else
+  memset(&stats, 0, sizeof(stats));
+#endif
+}
+
+
+bool FastROMFilesystem::EraseSector(int sector)
+{
+  if ((sector < 0) || (sector >= fs.md.sectors)) return false;
+
+  if (IsErased(sector)) { // Already done in idle time
+    FASTROMFS_ATOMIC_ADD(stats.preEraseHits, 1);
+    return true;
+  }
+  FASTROMFS_ATOMIC_ADD(stats.preEraseMisses, 1);
+  FASTROMFS_ATOMIC_ADD(stats.sectorErases, 1);
+  YieldPoint();
+  FASTROMFS_TIME_OP(this, FASTROMFS_OP_ERASE, sector);
+
+  DEBUG_FASTROMFS("EraseSector(%d)\n", sector);
+#ifdef ARDUINO
+  // If we're messing with this sector, invalidate any cached data corresponding to it
+  if (sector == lastFlashSector) lastFlashSector = -1;
+
+  if (!ESP.flashEraseSector(baseSector + sector)) return false;
+#else
+  if (simEraseUs) usleep(simEraseUs);
+  SimErase(sector);
+  simEraseCount[sector]++;
+#endif
+  SetErased(sector, true);
+  return true;
+}
+
+bool FastROMFilesystem::WriteSector(int sector, const void *data)
+{
+  DEBUG_FASTROMFS("WriteSector(%d, data)\n", sector);
+
+  if ((sector < 0) || (sector >= fs.md.sectors) || !data) return false;
+  if ((const uintptr_t)data % 4) return false; // Need to have 32-bit aligned inputs!
+
+  SetErased(sector, false);
+  FASTROMFS_ATOMIC_ADD(stats.sectorWrites, 1);
+  FASTROMFS_ATOMIC_ADD(stats.bytesProgrammed, SECTORSIZE);
+  YieldPoint();
+  FASTROMFS_TIME_OP(this, FASTROMFS_OP_PROGRAM, sector);
+#ifdef ARDUINO
+  // If we're messing with this sector, invalidate any cached data corresponding to it
+  if (sector == lastFlashSector) lastFlashSector = -1;
+
+  return ESP.flashWrite(baseAddr + sector * FLASH_SECTOR_SIZE, (uint32_t*)data, FLASH_SECTOR_SIZE);
+#else
+  if (flash[sector]) {
+    DEBUG_FASTROMFS("!!!ERROR, sector not erased!!!\n");
+    return false;
+  }
+  if (simWriteUs) usleep(simWriteUs);
+  memcpy(SimProgram(sector), data, SECTORSIZE);
+  return true;
+#endif
+}
+
+
+#if FASTROMFS_WRITEBEHIND
+#ifdef ARDUINO
+  // Single threaded, the pump is driven from loop()
+  #define WB_LOCK()
+  #define WB_UNLOCK()
+  #define WB_WAIT()
+  #define WB_SIGNAL()
+#else
+  #define WB_LOCK() pthread_mutex_lock(&wbMutex)
+  #define WB_UNLOCK() pthread_mutex_unlock(&wbMutex)
+  #define WB_WAIT() pthread_cond_wait(&wbCond, &wbMutex)
+  #define WB_SIGNAL() pthread_cond_broadcast(&wbCond)
+
+void *FastROMFilesystem::WriteBehindThread(void *arg)
+{
+  FastROMFilesystem *me = reinterpret_cast<FastROMFilesystem*>(arg);
+  pthread_mutex_lock(&me->wbMutex);
+  while (!me->wbStop) {
+    if (me->wbCount && !me->wbBusy) me->ProgramQueueHead();
+    else pthread_cond_wait(&me->wbCond, &me->wbMutex);
+  }
+  pthread_mutex_unlock(&me->wbMutex);
+  return NULL;
+}
+#endif
+
+// Called with the queue locked.  Drops the lock while the flash is busy so writers can keep queueing.
+void FastROMFilesystem::ProgramQueueHead()
+{
+  int slot = wbHead;
+  wbBusy = true;
+  WB_UNLOCK();
+  bool ok = EraseSector(wbSector[slot]) && WriteSector(wbSector[slot], wbData[slot]);
+  WB_LOCK();
+  if (!ok) wbError = true;
+  wbBusy = false;
+  wbHead = (wbHead + 1) % FASTROMFS_WRITEBEHIND_DEPTH;
+  wbCount--;
+  WB_SIGNAL();
+}
+
+// Called with the queue locked
+bool FastROMFilesystem::InQueue(int sector)
+{
+  for (int i = 0; i < wbCount; i++) {
+    if (wbSector[(wbHead + i) % FASTROMFS_WRITEBEHIND_DEPTH] == sector) return true;
+  }
+  return false;
+}
+
+// Serve reads of sectors that haven't made it to flash yet
+bool FastROMFilesystem::ReadQueued(int sector, int offset, void *dest, int len)
+{
+  bool found = false;
+  WB_LOCK();
+  for (int i = wbCount - 1; i >= 0; i--) {
+    int slot = (wbHead + i) % FASTROMFS_WRITEBEHIND_DEPTH;
+    if (wbSector[slot] == sector) {
+      memcpy(dest, reinterpret_cast<uint8_t*>(wbData[slot]) + offset, len);
+      found = true;
+      break;
+    }
+  }
+  WB_UNLOCK();
+  return found;
+}
+
+bool FastROMFilesystem::pump()
+{
+  WB_LOCK();
+  if (wbCount && !wbBusy) ProgramQueueHead();
+  bool more = wbCount > 0;
+  WB_UNLOCK();
+  return more;
+}
+
+void FastROMFilesystem::setWriteBehind(bool enable)
+{
+  FASTROMFS_LOCK_EXCLUSIVE(this);
+  if (enable == writeBehind) return;
+  if (!enable) DrainWriteBehind();
+#ifndef ARDUINO
+  if (enable) {
+    wbStop = false;
+    pthread_create(&wbThread, NULL, WriteBehindThread, this);
+  } else {
+    WB_LOCK();
+    wbStop = true;
+    WB_SIGNAL();
+    WB_UNLOCK();
+    pthread_join(wbThread, NULL);
+  }
+#endif
+  writeBehind = enable;
+}
+#endif
+
+// Wait for every queued sector to hit flash.  Returns false if any of them failed since the last call.
+bool FastROMFilesystem::DrainWriteBehind()
+{
+#if FASTROMFS_WRITEBEHIND
+  if (!writeBehind) return true;
+  WB_LOCK();
+  while (wbCount) {
+    if (wbBusy) WB_WAIT();
+    else ProgramQueueHead();
+  }
+  bool ok = !wbError;
+  wbError = false;
+  WB_UNLOCK();
+  return ok;
+#else
+  return true;
+#endif
+}
+
+// Whether a sector still has a copy waiting to be programmed
+bool FastROMFilesystem::IsQueued(int sector)
+{
+#if FASTROMFS_WRITEBEHIND
+  if (!writeBehind) return false;
+  WB_LOCK();
+  bool queued = InQueue(sector);
+  WB_UNLOCK();
+  return queued;
+#else
+  return false;
+#endif
+}
+
+// Program the queue up to the last copy of this sector.  Failures stay sticky for the next drain to report.
+void FastROMFilesystem::WaitUnqueued(int sector)
+{
+#if FASTROMFS_WRITEBEHIND
+  if (!writeBehind) return;
+  WB_LOCK();
+  while (InQueue(sector)) {
+    if (wbBusy) WB_WAIT();
+    else ProgramQueueHead();
+  }
+  WB_UNLOCK();
+#endif
+}
+
+// Erase and write a full data sector, or hand it to the write-behind queue
+bool FastROMFilesystem::ProgramSector(int sector, const void *data)
+{
+#if FASTROMFS_WRITEBEHIND
+  if (writeBehind) {
+    if ((sector < 0) || (sector >= fs.md.sectors) || !data) return false;
+    WB_LOCK();
+    // Replace a pending copy of this sector unless it's the one being programmed right now
+    for (int i = wbCount - 1; i >= 0; i--) {
+      int slot = (wbHead + i) % FASTROMFS_WRITEBEHIND_DEPTH;
+      if (wbSector[slot] != sector) continue;
+      if ((i == 0) && wbBusy) break;
+      memcpy(wbData[slot], data, SECTORSIZE);
+      WB_UNLOCK();
+      return true;
+    }
+    // Backpressure, do the work ourselves or wait for the worker to free a slot
+    while (wbCount == FASTROMFS_WRITEBEHIND_DEPTH) {
+      if (wbBusy) WB_WAIT();
+      else ProgramQueueHead();
+    }
+    int slot = (wbHead + wbCount) % FASTROMFS_WRITEBEHIND_DEPTH;
+    wbSector[slot] = sector;
+    memcpy(wbData[slot], data, SECTORSIZE);
+    wbCount++;
+    WB_SIGNAL();
+    WB_UNLOCK();
+    return true;
+  }
+#endif
+  if (!EraseSector(sector)) return false;
+  return WriteSector(sector, data);
+}
+
+// Program part of a sector that's already been written, can only clear bits.  Offset, length and data must be 32-bit aligned.
+bool FastROMFilesystem::ProgramPartialSector(int sector, int offset, const void *data, int len)
+{
+  if ((sector < 0) || (sector >= fs.md.sectors) || !data || (offset % 4) || (len % 4) || (offset + len > SECTORSIZE)) return false;
+  if ((const uintptr_t)data % 4) return false;
+  if (!len) return true;
+  DEBUG_FASTROMFS("ProgramPartialSector(%d, %d, data, %d)\n", sector, offset, len);
+#if FASTROMFS_WRITEBEHIND
+  if (writeBehind) {
+    // If there's a queued copy it is what "flash" looks like, so patch that instead
+    WB_LOCK();
+    for (int i = wbCount - 1; i >= 0; i--) {
+      int slot = (wbHead + i) % FASTROMFS_WRITEBEHIND_DEPTH;
+      if ((wbSector[slot] == sector) && !((i == 0) && wbBusy)) {
+        memcpy(reinterpret_cast<uint8_t*>(wbData[slot]) + offset, data, len);
+        WB_UNLOCK();
+        return true;
+      }
+    }
+    WB_UNLOCK();
+    if (!DrainWriteBehind()) return false; // Don't race the worker programming this sector
+  }
+#endif
+  SetErased(sector, false);
+  FASTROMFS_ATOMIC_ADD(stats.bytesProgrammed, len);
+  YieldPoint();
+  FASTROMFS_TIME_OP(this, FASTROMFS_OP_PROGRAM, sector);
+#ifdef ARDUINO
+  if (sector == lastFlashSector) lastFlashSector = -1;
+  return ESP.flashWrite(baseAddr + sector * FLASH_SECTOR_SIZE + offset, (uint32_t*)data, len);
+#else
+  if (simWriteUs) usleep(1 + (simWriteUs * len) / SECTORSIZE);
+  const uint8_t *src = reinterpret_cast<const uint8_t*>(data);
+  uint8_t *dest = SimProgram(sector) + offset;
+  for (int i = 0; i < len; i++) dest[i] &= src[i]; // NOR only goes 1->0
+  return true;
+#endif
+}
+
+bool FastROMFilesystem::ReadSector(int sector, void *data)
+{
+  if ((sector < 0) || (sector >= fs.md.sectors) || !data) return false;
+  if ((const uintptr_t)data % 4) return false; // Need to have 32-bit aligned inputs!
+#if FASTROMFS_WRITEBEHIND
+  if (ReadQueued(sector, 0, data, SECTORSIZE)) return true;
+#endif
+  FASTROMFS_STAT_ADD(bytesRead, SECTORSIZE);
+  FASTROMFS_TIME_OP(this, FASTROMFS_OP_FLASHREAD, sector);
+
+#ifdef ARDUINO
+  return ESP.flashRead(baseAddr + sector * FLASH_SECTOR_SIZE, (uint32_t*)data, FLASH_SECTOR_SIZE);
+#else
+  if (simReadUsPerKB) usleep(simReadUsPerKB * (SECTORSIZE / 1024));
+  SimRead(sector, 0, data, SECTORSIZE);
+  return true;
+#endif
+}
+
+// Aligned words straight out of flash, offset must be 32-bit aligned
+bool FastROMFilesystem::ReadFlashWords(int sector, int offset, uint32_t *dest, int words)
+{
+#if defined(ARDUINO) && !FASTROMFS_THREADSAFE
+  // Check if we have cached this data (only valid if it's a single 32-bit word).
+  // Very special-case, but sequential 1-byte scanning occurs in many applications.
+  if (words == 1) {
+    if ( (lastFlashSector == sector) && (lastFlashSectorOffset == offset) ) {
+      *dest = lastFlashSectorData;
+      return true;
+    }
+    FASTROMFS_STAT_ADD(bytesRead, 4);
+    if (!ESP.flashRead(baseAddr + sector * FLASH_SECTOR_SIZE + offset, dest, 4)) return false;
+    lastFlashSector = sector;
+    lastFlashSectorOffset = offset;
+    lastFlashSectorData = *dest;
+    return true;
+  }
+#endif
+  FASTROMFS_STAT_ADD(bytesRead, words * 4);
+#ifdef ARDUINO
+  return ESP.flashRead(baseAddr + sector * FLASH_SECTOR_SIZE + offset, dest, words * 4);
+#else
+  SimRead(sector, offset, dest, words * 4);
+  return true;
+#endif
+}
+
+bool FastROMFilesystem::ReadPartialSector(int sector, int offset, void *data, int len)
+{
+  if ((sector < 0) || (sector >= fs.md.sectors) || !data || (len < 0) || (offset < 0) || (offset + len > SECTORSIZE)) return false;
+#if FASTROMFS_WRITEBEHIND
+  if (ReadQueued(sector, offset, data, len)) return true;
+#endif
+  FASTROMFS_TIME_OP(this, FASTROMFS_OP_FLASHREAD, sector);
+#ifndef ARDUINO
+  if (simReadUsPerKB) usleep(1 + (simReadUsPerKB * len) / 1024);
+#endif
+
+  // Easy case, everything is aligned and we can just do it...
+  if ( ((offset % 4) == 0) && ((len % 4) == 0) && (((const uintptr_t)data % 4) == 0) ) {
+    return ReadFlashWords(sector, offset, (uint32_t*)data, len / 4);
+  }
+
+  // Misaligned somewhere.  Stream aligned words out of flash a chunk at a time and merge them into the
+  // destination: bytes until RAM is aligned, then whole words built from two shifted flash words, then
+  // whatever's left over.  Little-endian only, which covers the ESP8266 and any sane host.
+  uint8_t *dest = reinterpret_cast<uint8_t*>(data);
+  int pos = offset; // Next flash byte to deliver
+  int remaining = len;
+  while (remaining) {
+    uint32_t chunk[32];
+    int wordAddr = pos & ~3;
+    int words = min((int)(sizeof(chunk) / sizeof(chunk[0])), (pos + remaining - wordAddr + 3) / 4);
+    if (!ReadFlashWords(sector, wordAddr, chunk, words)) return false;
+    const uint8_t *src = reinterpret_cast<const uint8_t*>(chunk) + (pos - wordAddr);
+    int todo = min(remaining, words * 4 - (pos - wordAddr));
+    pos += todo;
+    remaining -= todo;
+
+    while (todo && ((uintptr_t)dest & 3)) {
+      *(dest++) = *(src++);
+      todo--;
+    }
+    int shift = (uintptr_t)src & 3; // chunk[] is aligned, so this is the byte shift between flash and RAM
+    const uint32_t *srcWord = reinterpret_cast<const uint32_t*>(src - shift);
+    uint32_t *destWord = reinterpret_cast<uint32_t*>(dest);
+    int outWords = todo / 4;
+    if (shift == 0) {
+      for (int i = 0; i < outWords; i++) destWord[i] = srcWord[i];
+    } else {
+      // Every output word lies inside this chunk, so srcWord[i + 1] never runs off the end
+      int rs = shift * 8;
+      int ls = 32 - rs;
+      for (int i = 0; i < outWords; i++) destWord[i] = (srcWord[i] >> rs) | (srcWord[i + 1] << ls);
+    }
+    dest += outWords * 4;
+    src += outWords * 4;
+    todo -= outWords * 4;
+    while (todo--) *(dest++) = *(src++);
+  }
+
+#if FASTROMFS_VERIFY_READS && !defined(ARDUINO)
+  uint8_t verify[SECTORSIZE];
+  SimRead(sector, offset, verify, len);
+  if (memcmp(data, verify, len))
+    DEBUG_FASTROMFS("ERROR!  Misaligned read data doesn't match correct\n");
+#endif
+  return true;
+}
+
+bool FastROMFilesystem::mkfs()
+{
+  FASTROMFS_LOCK_EXCLUSIVE(this);
+  if (fsIsMounted) return false;
+  memset(&fs, 0, sizeof(fs));
   fs.md.magic = FSMAGIC;
   fs.md.epoch = 1;
   fs.md.sectors = totalSectors;
+#if FASTROMFS_LOWRAM
+  memset(nameHash, 0, sizeof(nameHash));
+  for (int i = 0; i < FASTROMFS_LOWRAM_NAMES; i++) pendingName[i].idx = -1;
+#endif
+#if FASTROMFS_UNPACKEDFAT
+  memset(fat16, 0, sizeof(fat16));
+#endif
+#if FASTROMFS_MAX_FILES > FILEENTRIES
+  memset(dirEntry, 0, sizeof(dirEntry));
+  dirDirty = 0;
+  dirChainLen = 0;
+  NameIndexRebuild();
+#endif
   for (int i = 0; i < FATCOPIES; i++) {
     SetFAT(i, FATEOF);
     fatSector[i] = i;
   }
+#if FASTROMFS_UNPACKEDFAT
+  PackFAT();
+#endif
   for (int i = 0; i < FATCOPIES; i++) {
     if (!EraseSector(i)) return false;
+#if FASTROMFS_LOWRAM
+    if (!WriteFATSector(i)) return false;
+#else
     if (!WriteSector(i, &fs)) return false;
+#endif
   }
   // Fake Flush() out to ensure we're written...
   fsIsMounted = true;
@@ -566,6 +2030,8 @@ bool FastROMFilesystem::mkfs()
 
 bool FastROMFilesystem::mount()
 {
+  FASTROMFS_TRACE_CALL(this, FASTROMFS_TRACE_MOUNT, NULL, 0, 0, 0);
+  FASTROMFS_LOCK_EXCLUSIVE(this);
   DEBUG_FASTROMFS("mount()\n");
   if (fsIsMounted) return false;
   fs.md.sectors = totalSectors; // We can potentially read up to this many sectors...
@@ -575,6 +2041,10 @@ bool FastROMFilesystem::mount()
   memset(fatEpoch, 0, sizeof(fatEpoch));
   for (int i = 0; i < FATCOPIES; i++) {
     fatSector[i] = i;
+#if FASTROMFS_LOWRAM
+    int64_t epoch;
+    fatEpoch[i] = ValidateFATSector(i, &epoch) ? epoch : 0;
+#else
     if (!ReadSector(i, &fs)) {
       // Error here, set epoch to 0
       fatEpoch[i] = 0;
@@ -586,6 +2056,7 @@ bool FastROMFilesystem::mount()
       continue;
     }
     fatEpoch[i] = fs.md.epoch;
+#endif
   }
   // Sort the list highest epoch(newest) to oldest)
   // FATENTRIES small, bubble sort is fine
@@ -606,8 +2077,36 @@ bool FastROMFilesystem::mount()
     DEBUG_FASTROMFS("fatSector[%d] = %d, epoch = %ld\n", (int)i, (int)fatSector[i], (long)fatEpoch[i]);
 
   // Read in the newest and continue...
+#if FASTROMFS_LOWRAM
+  if (!fatEpoch[0]) return false; // Nothing valid
+  if (!LoadFATSector(fatSector[0])) return false;
+#else
   if (!ReadSector(fatSector[0], &fs)) return false;
   if (!ValidateFAT()) return false;
+#endif
+  if ((uint32_t)fs.md.sectors > totalSectors) return false; // Doesn't fit in what we were given
+#if FASTROMFS_UNPACKEDFAT
+  UnpackFAT();
+#endif
+#if FASTROMFS_MAX_FILES > FILEENTRIES
+  if (!LoadDirChain()) return false;
+#endif
+  uint8_t shared[MAXFATENTRIES / 8];
+  clones = FindSharedSectors(shared);
+
+  // Nothing about erase state survives a reboot, so seed the pool from free sectors that read back blank.
+  // Bounded so a full, dirty filesystem doesn't make mount() crawl.
+  memset(erasedMap, 0, sizeof(erasedMap));
+  int found = 0;
+  int a = Random() % fs.md.sectors;
+  for (int i = 0, tries = 0; (i < fs.md.sectors) && (found < FASTROMFS_PREERASE_DEPTH) && (tries < 4 * FASTROMFS_PREERASE_DEPTH); i++, a = (a + 1) % fs.md.sectors) {
+    if (GetFAT(a) != 0) continue;
+    tries++;
+    if (IsSectorBlank(a)) {
+      SetErased(a, true);
+      found++;
+    }
+  }
 
   fsIsDirty = false;
   fsIsMounted = true;
@@ -616,6 +2115,8 @@ bool FastROMFilesystem::mount()
 
 bool FastROMFilesystem::umount()
 {
+  FASTROMFS_TRACE_CALL(this, FASTROMFS_TRACE_UMOUNT, NULL, 0, 0, 0);
+  FASTROMFS_LOCK_EXCLUSIVE(this);
   if (!fsIsMounted) return false;
   DEBUG_FASTROMFS("umount()\n");
   if (!FlushFAT()) return false;
@@ -626,9 +2127,30 @@ bool FastROMFilesystem::umount()
 bool FastROMFilesystem::FlushFAT()
 {
   DEBUG_FASTROMFS("FlushFAT(), ismounted=%d, isdirty=%d\n", !!fsIsMounted, !!fsIsDirty);
-  if (!fsIsMounted || !fsIsDirty) return true; // Nothing to do here...
-
+  if (!fsIsMounted) return true; // Nothing to do here...
+  // Metadata must never point at data that's still sitting in the write-behind queue
+  if (!DrainWriteBehind()) return false;
+  if (!fsIsDirty) return true;
+  FASTROMFS_TIME_OP(this, FASTROMFS_OP_FLUSHFAT, fatSector[FATCOPIES-1]);
+
+#if FASTROMFS_MAX_FILES > FILEENTRIES
+  if (dirDirty && !WriteDirChain()) return false;
+#endif
   fs.md.epoch++;
+#if FASTROMFS_UNPACKEDFAT
+  PackFAT();
+#endif
+#if FASTROMFS_LOWRAM
+  // Names come out of the current newest copy while writing, so only rotate the list once the new one is good
+  int idx = fatSector[FATCOPIES-1];
+  if (!EraseSector(idx)) return false;
+  if (!WriteFATSector(idx)) return false;
+  memmove(&fatSector[1], &fatSector[0], sizeof(uint8_t)*(FATCOPIES-1));
+  fatSector[0] = idx;
+  for (int i = 0; i < FASTROMFS_LOWRAM_NAMES; i++) pendingName[i].idx = -1;
+  fsIsDirty = false;
+  return true;
+#else
   fs.md.crc = 0;
   uint32_t calcCRC = 0;
   CRC32((void*)&fs, sizeof(fs), &calcCRC);
@@ -640,60 +2162,291 @@ bool FastROMFilesystem::FlushFAT()
   bool ret = WriteSector(idx, &fs);
   if (ret) fsIsDirty = false;
   return ret;
+#endif
+}
+
+#if FASTROMFS_LOWRAM
+// On-flash header of FilesystemInFlash
+typedef struct {
+  uint64_t magic;
+  int64_t epoch;
+  int32_t sectors;
+  uint32_t crc;
+} FilesystemHeader;
+
+#define FILEENTRYCHUNK 8 // Entries moved per flash access when streaming metadata
+
+// Cheap 8-bit name hash for the resident lookup table, never 0 so 0 can mean "unused entry"
+uint8_t FastROMFilesystem::NameHash(const char *name)
+{
+  if (!name[0]) return 0;
+  uint32_t h = 2166136261UL;
+  for (int i = 0; (i < NAMELEN) && name[i]; i++) h = (h ^ (uint8_t)name[i]) * 16777619UL;
+  return 1 + (h % 255);
+}
+
+// CRC a metadata sector straight from flash, without needing a 4KB buffer to hold it
+bool FastROMFilesystem::ValidateFATSector(int sector, int64_t *epoch)
+{
+  FilesystemHeader hdr;
+  if (!ReadPartialSector(sector, 0, &hdr, sizeof(hdr))) return false;
+  if (hdr.magic != FSMAGIC) return false;
+  uint32_t savedCRC = hdr.crc;
+  uint32_t calcCRC = 0;
+  hdr.crc = 0;
+  CRC32(&hdr, sizeof(hdr), &calcCRC);
+  uint32_t buff[64];
+  for (int off = sizeof(hdr); off < SECTORSIZE; off += sizeof(buff)) {
+    int len = min((int)sizeof(buff), SECTORSIZE - off);
+    if (!ReadPartialSector(sector, off, buff, len)) return false;
+    CRC32(buff, len, &calcCRC);
+  }
+  if (savedCRC != calcCRC) return false; // Something baaaad here!
+  *epoch = hdr.epoch;
+  return true;
+}
+
+// Pull in everything but the names, which are hashed and left on flash
+bool FastROMFilesystem::LoadFATSector(int sector)
+{
+  FilesystemHeader hdr;
+  if (!ReadPartialSector(sector, 0, &hdr, sizeof(hdr))) return false;
+  fs.md.magic = hdr.magic;
+  fs.md.epoch = hdr.epoch;
+  fs.md.sectors = hdr.sectors;
+  fs.md.crc = hdr.crc;
+  for (int i = 0; i < FILEENTRIES; i += FILEENTRYCHUNK) {
+    FileEntry e[FILEENTRYCHUNK];
+    if (!ReadPartialSector(sector, offsetof(FilesystemInFlash, md.fileEntry) + i * sizeof(FileEntry), e, sizeof(e))) return false;
+    for (int j = 0; j < FILEENTRYCHUNK; j++) {
+      fs.md.fileEntry[i + j].fat = e[j].fat;
+      fs.md.fileEntry[i + j].len = e[j].len;
+      nameHash[i + j] = NameHash(e[j].name);
+    }
+  }
+  if (!ReadPartialSector(sector, offsetof(FilesystemInFlash, md.fat), fs.md.fat, sizeof(fs.md.fat))) return false;
+  if (!ReadPartialSector(sector, offsetof(FilesystemInFlash, md.dirSector), &fs.md.dirSector, sizeof(fs.md.dirSector))) return false;
+  for (int i = 0; i < FASTROMFS_LOWRAM_NAMES; i++) pendingName[i].idx = -1;
+  return true;
+}
+
+// Program the in-RAM metadata into an erased sector a piece at a time, CRC'ing as it goes.  Unchanged names are
+// copied over from the current newest copy.  The header goes last since it holds the CRC.
+bool FastROMFilesystem::WriteFATSector(int sector)
+{
+  FilesystemHeader hdr = { fs.md.magic, fs.md.epoch, fs.md.sectors, 0 };
+  uint32_t calcCRC = 0;
+  CRC32(&hdr, sizeof(hdr), &calcCRC);
+
+  for (int i = 0; i < FILEENTRIES; i += FILEENTRYCHUNK) {
+    FileEntry e[FILEENTRYCHUNK];
+    int off = offsetof(FilesystemInFlash, md.fileEntry) + i * sizeof(FileEntry);
+    bool haveOld = false;
+    for (int j = 0; j < FILEENTRYCHUNK; j++) {
+      if (nameHash[i + j]) haveOld = true;
+    }
+    if (haveOld && !ReadPartialSector(fatSector[0], off, e, sizeof(e))) return false;
+    for (int j = 0; j < FILEENTRYCHUNK; j++) {
+      if (!nameHash[i + j]) memset(e[j].name, 0, NAMELEN);
+      for (int k = 0; k < FASTROMFS_LOWRAM_NAMES; k++) {
+        if (pendingName[k].idx == i + j) memcpy(e[j].name, pendingName[k].name, NAMELEN);
+      }
+      e[j].fat = fs.md.fileEntry[i + j].fat;
+      e[j].len = fs.md.fileEntry[i + j].len;
+    }
+    CRC32(e, sizeof(e), &calcCRC);
+    if (!ProgramPartialSector(sector, off, e, sizeof(e))) return false;
+  }
+
+  CRC32(fs.md.fat, sizeof(fs.md.fat), &calcCRC);
+  if (!ProgramPartialSector(sector, offsetof(FilesystemInFlash, md.fat), fs.md.fat, sizeof(fs.md.fat))) return false;
+  CRC32(&fs.md.dirSector, sizeof(fs.md.dirSector), &calcCRC);
+  if (!ProgramPartialSector(sector, offsetof(FilesystemInFlash, md.dirSector), &fs.md.dirSector, sizeof(fs.md.dirSector))) return false;
+
+  // The rest of the sector is filler, left erased
+  uint8_t filler[64];
+  memset(filler, 0xff, sizeof(filler));
+  for (int off = offsetof(FilesystemInFlash, md.dirSector) + sizeof(fs.md.dirSector); off < SECTORSIZE; off += sizeof(filler)) {
+    CRC32(filler, min((int)sizeof(filler), SECTORSIZE - off), &calcCRC);
+  }
+
+  hdr.crc = calcCRC;
+  return ProgramPartialSector(sector, 0, &hdr, sizeof(hdr));
 }
+#endif
 
 FastROMFile *FastROMFilesystem::open(const char *name, const char *mode)
 {
+  FASTROMFS_TIME_OP(this, FASTROMFS_OP_OPEN, -1);
+  FastROMFile *f = OpenFile(name, mode);
+  FASTROMFS_TRACE_CALL(this, FASTROMFS_TRACE_OPEN, f, mode ? ((uint8_t)mode[0] | (strchr(mode, '+') ? 0x100 : 0)) : 0, TraceNameHash(name), f ? 0 : -1);
+  return f;
+}
+
+FastROMFile *FastROMFilesystem::OpenFile(const char *name, const char *mode)
+{
+  FASTROMFS_LOCK_EXCLUSIVE(this);
   if (!fsIsMounted) return NULL;
   if (!name || !mode || !name[0] || !mode[0]) return NULL;
+  StartBudget();
 
   DEBUG_FASTROMFS("open('%s', '%s')\n", name, mode);
+  // Fail fast, before "w" gets a chance to truncate anything, when there's no handle or write buffer to hand out.
+  // r+/a/a+ on a file someone's already writing share that writer's buffer.
+  bool write = (mode[0] != 'r') || (mode[1] == '+');
+  if (PoolFull(handleUsed, FASTROMFS_MAX_OPEN_FILES) || (write && PoolFull(bufferUsed, FASTROMFS_MAX_WRITE_BUFFERS))) {
+    int fidx = (mode[0] == 'w') ? -1 : FindFileEntryByName(name);
+    FastROMFileShared *sh = (fidx < 0) ? NULL : FindShared(fidx);
+    if (PoolFull(handleUsed, FASTROMFS_MAX_OPEN_FILES) || !sh || !sh->data) {
+      stats.poolExhausted++;
+      return NULL;
+    }
+  }
+  if (write && (mode[0] != 'w')) {
+    int fidx = FindFileEntryByName(name);
+    if ((fidx >= 0) && GetFileEntryCompressed(fidx)) return NULL; // Read-only, "w" replaces it
+  }
   if (!strcmp(mode, "r") || !strcmp(mode, "rb")) { //  Open text file for reading.  The stream is positioned at the beginning of the file.
     int fidx = FindFileEntryByName(name);
     if (fidx < 0) return NULL;
-    return new FastROMFile(this, fidx, 0, 0,  true, false, false, false);
+    return OpenHandle(fidx, 0, 0,  true, false, false, false);
   } else if (!strcmp(mode, "r+") || !strcmp(mode, "r+b")) { // Open for reading and writing.  The stream is positioned at the beginning of the file.
     int fidx = FindFileEntryByName(name);
     if (fidx < 0) return NULL;
-    return new FastROMFile(this, fidx, 0, 0,  true, true, false, false);
+    return OpenHandle(fidx, 0, 0,  true, true, false, false);
   } else if (!strcmp(mode, "w") || !strcmp(mode, "wb")) { // Truncate file to zero length or create text file for writing.  The stream is positioned at the beginning of the file.
-    unlink(name); // ignore failure, may not exist
+    RemoveFileEntry(name); // ignore failure, may not exist
     int fidx = CreateNewFileEntry(name);
     if (fidx < 0) return NULL; // No directory space left
-    return new FastROMFile(this, fidx, 0, 0, false, true, false, true);
+    return OpenHandle(fidx, 0, 0, false, true, false, true);
   } else if (!strcmp(mode, "w+") || !strcmp(mode, "w+b")) { // Open for reading and writing.  The file is created if it does not exist, otherwise it is truncated.  The stream is positioned at the beginning of the file.
-    unlink(name); // ignore failure, may not exist
+    RemoveFileEntry(name); // ignore failure, may not exist
     int fidx = CreateNewFileEntry(name);
     if (fidx < 0) return NULL; // No directory space left
-    return new FastROMFile(this, fidx, 0, 0, true, true, false, true);
+    return OpenHandle(fidx, 0, 0, true, true, false, true);
   } else if (!strcmp(mode, "a") || !strcmp(mode, "ab")) { // Open for appending (writing at end of file).  The file is created if it does not exist.  The stream is positioned at the end of the file.
     int fidx = FindFileEntryByName(name);
     int sfidx = fidx;
     if (fidx < 0) fidx = CreateNewFileEntry(name);
     if (fidx < 0) return NULL; // No directory space left
-    return new FastROMFile(this, fidx, 0, fs.md.fileEntry[fidx].len, false, true, true, sfidx < 0 ? true : false);
+    return OpenHandle(fidx, 0, GetFileEntryLen(fidx), false, true, true, sfidx < 0 ? true : false);
   } else if (!strcmp(mode, "a+") || !strcmp(mode, "a+b")) { // Open for reading and appending (writing at end of file).  The file is created if it does not exist.  The initial file position for reading is at the beginning of the file, but output is always appended to the end of the file.
     int fidx = FindFileEntryByName(name);
     int sfidx = fidx;
     if (fidx < 0) fidx = CreateNewFileEntry(name);
     if (fidx < 0) return NULL; // No directory space left
-    return new FastROMFile(this, fidx, 0, fs.md.fileEntry[fidx].len, true, true, true, sfidx < 0 ? true : false);
+    return OpenHandle(fidx, 0, GetFileEntryLen(fidx), true, true, true, sfidx < 0 ? true : false);
+  }
+  return NULL;
+}
+
+FastROMFileShared *FastROMFilesystem::FindShared(int fileIdx)
+{
+  for (FastROMFileShared *sh = openFiles; sh; sh = sh->next) {
+    if (sh->fileIdx == fileIdx) return sh;
   }
   return NULL;
 }
 
+FastROMFileShared *FastROMFilesystem::AcquireShared(int fileIdx, bool write)
+{
+  FastROMFileShared *sh = FindShared(fileIdx);
+  if (!sh) {
+    int slot = PoolAlloc(&sharedUsed, FASTROMFS_MAX_OPEN_FILES);
+    if (slot < 0) return NULL; // Can't happen with a handle slot in hand, but be safe
+    sh = &sharedPool[slot];
+    sh->fileIdx = fileIdx;
+    sh->refs = 0;
+    sh->data = NULL;
+    sh->dataDirty = false;
+    sh->curWriteSector = -1;
+    sh->curWriteSectorOffset = -SECTORSIZE;
+    sh->prevWriteSector = -1;
+    sh->cowPending = false;
+    sh->chainGen = 0;
+    sh->dataGen = 0;
+    sh->zBlock = -1;
+    sh->next = openFiles;
+    openFiles = sh;
+  }
+  if (write && !sh->data) {
+    int slot = PoolAlloc(&bufferUsed, FASTROMFS_MAX_WRITE_BUFFERS);
+    if (slot < 0) {
+      if (!sh->refs) ReleaseShared(sh);
+      return NULL; // All write buffers in use
+    }
+    sh->data = reinterpret_cast<uint8_t*>(bufferPool[slot]);
+  }
+  sh->refs++;
+  return sh;
+}
+
+void FastROMFilesystem::ReleaseShared(FastROMFileShared *sh)
+{
+  if (sh->refs > 0) sh->refs--;
+  if (sh->refs) return;
+  for (FastROMFileShared **p = &openFiles; *p; p = &(*p)->next) {
+    if (*p == sh) {
+      *p = sh->next;
+      break;
+    }
+  }
+  if (sh->data) PoolFree(&bufferUsed, (sh->data - reinterpret_cast<uint8_t*>(bufferPool)) / sizeof(bufferPool[0]));
+  PoolFree(&sharedUsed, sh - sharedPool);
+}
+
+// The entry is going away under any open handles, so detach them.  Their buffered data goes with it.
+void FastROMFilesystem::OrphanShared(int fileIdx)
+{
+  FastROMFileShared *sh = FindShared(fileIdx);
+  if (!sh) return;
+  sh->fileIdx = -1;
+  sh->dataDirty = false;
+  sh->curWriteSector = -1;
+  sh->curWriteSectorOffset = -SECTORSIZE;
+  sh->chainGen++;
+  sh->dataGen++;
+}
+
+FastROMFile *FastROMFilesystem::OpenHandle(int fileIdx, int readOffset, int writeOffset, bool read, bool write, bool append, bool eraseFirstSector)
+{
+  int slot = PoolAlloc(&handleUsed, FASTROMFS_MAX_OPEN_FILES);
+  if (slot < 0) return NULL; // Too many open
+  FastROMFile *f = new (handlePool[slot]) FastROMFile(this, fileIdx, readOffset, writeOffset, read, write, append, eraseFirstSector);
+  if (!f->shared) { // No write buffer left
+    CloseHandle(f);
+    return NULL;
+  }
+  return f;
+}
+
+void FastROMFilesystem::CloseHandle(FastROMFile *f)
+{
+  f->~FastROMFile();
+  PoolFree(&handleUsed, (reinterpret_cast<uint8_t*>(f) - reinterpret_cast<uint8_t*>(handlePool)) / sizeof(handlePool[0]));
+}
+
+// Hand out the lowest free slot of a pool, or -1 (and count it) when they're all taken
+int FastROMFilesystem::PoolAlloc(uint32_t *used, int count)
+{
+  for (int i = 0; i < count; i++) {
+    if (!(*used & (1UL << i))) {
+      *used |= 1UL << i;
+      return i;
+    }
+  }
+  stats.poolExhausted++;
+  return -1;
+}
+
 FastROMFile::~FastROMFile()
 {
   DEBUG_FASTROMFS("FastROMFile::~FastROMFile\n");
-  if (modeWrite || modeAppend) {
-    if (dataDirty) {
-      fs->EraseSector(curWriteSector);
-      fs->WriteSector(curWriteSector, data);
-    }
-    dataDirty = false;
+  if (shared) {
+    if (modeWrite || modeAppend) FlushData();
+    fs->ReleaseShared(shared);
   }
-  free(data);
-  data = NULL;
+  shared = NULL;
 }
 
 FastROMFile::FastROMFile(FastROMFilesystem *fs, int fileIdx, int readOffset, int writeOffset, bool read, bool write, bool append, bool eraseFirstSector)
@@ -705,33 +2458,154 @@ FastROMFile::FastROMFile(FastROMFilesystem *fs, int fileIdx, int readOffset, int
   this->modeAppend = append;
   this->fileIdx = fileIdx;
 
-  if (modeWrite || modeAppend) {
-    data = (uint8_t*)malloc(SECTORSIZE);
-    if (eraseFirstSector) {
-      memset(data, 0, SECTORSIZE);
-      fs->EraseSector(fs->GetFileEntryFAT(fileIdx));
-      fs->WriteSector(fs->GetFileEntryFAT(fileIdx), data);
+  // A trimmed log's offsets start at its head, there's nothing below it to read or write
+  readPos = max(readOffset, fs->GetFileEntryHead(fileIdx));
+  writePos = max(writeOffset, fs->GetFileEntryHead(fileIdx));
+
+  curReadSector = -1;
+  curReadSectorOffset = -SECTORSIZE;
+  readLinePos = 0;
+  readLineLen = 0;
+
+  compressed = fs->GetFileEntryCompressed(fileIdx);
+  rawLen = compressed ? fs->GetFileEntryDataLen(fileIdx) : 0;
+
+  // Compressed files decode into the buffer a writer would use
+  shared = fs->AcquireShared(fileIdx, modeWrite || modeAppend || compressed);
+  if (!shared) return; // OOM, open() will clean up
+  readChainGen = shared->chainGen;
+
+  if ((modeWrite || modeAppend) && eraseFirstSector) {
+    memset(shared->data, 0, SECTORSIZE);
+    fs->ProgramSector(fs->GetFileEntryFAT(fileIdx), shared->data);
+  }
+}
+
+bool FastROMFile::FlushData()
+{
+  if (!shared->dataDirty) return true;
+  bool clonedSector = false;
+  if (fs->clones) {
+    // The links leading here have to be ours to change, and a sector a clone still reads can only be copied
+    int n = fs->UnshareChain(fileIdx, (shared->curWriteSectorOffset - fs->GetFileEntryHead(fileIdx)) / SECTORSIZE);
+    if (n < 0) return false;
+    if (n > 0) {
+      clonedSector = true;
+      shared->cowPending = true;
+      shared->clearOnly = false;
     }
-  } else {
-    data = NULL;
   }
-  dataDirty = false;
+  if (shared->cowPending) {
+    // Every change only cleared bits, so NOR can take it in place.  No erase, no new sector, no FAT change.
+    if (shared->clearOnly) {
+      int lo = shared->dirtyLo & ~3;
+      int hi = (shared->dirtyHi + 3) & ~3;
+      if (!fs->ProgramPartialSector(shared->curWriteSector, lo, &shared->data[lo], hi - lo)) return false;
+      fs->stats.inPlaceUpdates++;
+      shared->dataDirty = false;
+      shared->dirtyLo = SECTORSIZE;
+      shared->dirtyHi = 0;
+      return true;
+    }
+    // Copy-on-write to a new sector, as long as the chain still looks like it did when we loaded it
+    int linkedFrom = (shared->prevWriteSector < 0) ? fs->GetFileEntryFAT(fileIdx) : fs->GetFAT(shared->prevWriteSector);
+    int newSector = (linkedFrom == shared->curWriteSector) ? fs->FindFreeSector() : -1;
+    if (newSector > 0) {
+      fs->SetFAT(newSector, fs->GetFAT(shared->curWriteSector));
+      if (shared->prevWriteSector < 0) fs->SetFileEntryFAT(fileIdx, newSector);
+      else fs->SetFAT(shared->prevWriteSector, newSector);
+      if (!clonedSector) fs->SetFAT(shared->curWriteSector, 0); // Free original block
+      shared->curWriteSector = newSector;
+      shared->chainGen++; // Any reader sitting on the old block needs to re-walk
+    } else if (clonedSector) {
+      return false; // Rewriting it in place would change the clone too
+    } else {
+      // No space, just rewrite it where it is...
+    }
+    shared->cowPending = false;
+  }
+  if (!fs->ProgramSector(shared->curWriteSector, shared->data)) return false;
+  shared->dataDirty = false;
+  return true;
+}
+
+// Load the buffer with a sector that's already on flash.  It's left where it is until FlushData() decides how to write it.
+bool FastROMFile::LoadData(int sector, int prevSector)
+{
+  shared->prevWriteSector = prevSector;
+  shared->curWriteSector = sector;
+  if (!fs->ReadSector(sector, shared->data)) return false;
+  shared->cowPending = true;
+  shared->clearOnly = true;
+  shared->dirtyLo = SECTORSIZE;
+  shared->dirtyHi = 0;
+  return true;
+}
 
-  readPos = readOffset;
-  writePos = writeOffset;
+// Start a sector with no data on flash yet
+void FastROMFile::NewData(int sector, int prevSector)
+{
+  shared->prevWriteSector = prevSector;
+  shared->curWriteSector = sector;
+  memset(shared->data, 0, SECTORSIZE);
+  shared->cowPending = false;
+}
 
-  curWriteSector = -1;
-  curWriteSectorOffset = -SECTORSIZE;
-  curReadSector = -1;
-  curReadSectorOffset = -SECTORSIZE;
+void FastROMFile::UpdateData(int offset, const uint8_t *src, int len)
+{
+  uint8_t *dest = &shared->data[offset];
+  if (shared->cowPending && shared->clearOnly) {
+    for (int i = 0; i < len; i++) {
+      if (src[i] & ~dest[i]) {
+        shared->clearOnly = false; // Needs an erase after all
+        break;
+      }
+    }
+  }
+  memcpy(dest, src, len);
+  shared->dirtyLo = min(shared->dirtyLo, offset);
+  shared->dirtyHi = max(shared->dirtyHi, offset + len);
+  shared->dataDirty = true; // We need to flush this on close() or leaving the sector
+  shared->dataGen++;
+}
+
+#if FASTROMFS_THREADSAFE
+bool FastROMFile::ReadLineHit()
+{
+  FASTROMFS_LOCK_SHARED(fs);
+  return ReadLineValid();
+}
+#endif
 
+// Slow path for the inlined Stream read()/peek(), pull in the aligned 32 bytes around the read position.  The caller
+// gets its byte from this line even if a writer bumps the generation straight after, the next call refills.
+bool FastROMFile::FillReadLine()
+{
+  if (!modeRead) return false;
+  int32_t savedReadPos = readPos;
+  int32_t savedWritePos = writePos;
+  readPos &= ~(int32_t)(sizeof(readLine) - 1);
+  int want, got = 0;
+  FastROMFSIOVec iov = { readLine, 0 };
+  {
+    // Generation, length and bytes from one look, or a write in between would make a good line look stale
+    FASTROMFS_LOCK_SHARED(fs);
+    want = min((int)sizeof(readLine), DataLen() - readPos);
+    readLineGen = shared->dataGen;
+    iov.len = (size_t)max(want, 0);
+    if ((want > savedReadPos - readPos) && !compressed && (shared->fileIdx == fileIdx)) got = ReadChain(&readPos, &iov, 1);
+  }
+  if ((want > savedReadPos - readPos) && compressed) got = ReadV(&iov, 1); // Never written, takes its own lock
+  readLinePos = readPos - got;
+  readLineLen = got;
+  readPos = savedReadPos;
+  writePos = savedWritePos;
+  return (uint32_t)(readPos - readLinePos) < (uint32_t)readLineLen;
 }
 
 int FastROMFile::fgetc()
 {
-  uint8_t c;
-  if (0 == read(&c, 1)) return -1;
-  return c;
+  return read();
 }
 
 int FastROMFile::fputc(int c)
@@ -743,11 +2617,18 @@ int FastROMFile::fputc(int c)
 
 int FastROMFile::size()
 {
-  return fs->GetFileEntryLen(fileIdx);
+  FASTROMFS_LOCK_SHARED(fs);
+  return DataLen();
+}
+
+int FastROMFile::DataLen()
+{
+  return compressed ? rawLen : fs->GetFileEntryLen(fileIdx);
 }
 
 void FastROMFile::name(char *buff, int len)
 {
+  FASTROMFS_LOCK_SHARED(fs);
   char name[NAMELEN + 1];
   fs->GetFileEntryName(fileIdx, name);
   name[NAMELEN] = 0;
@@ -764,149 +2645,226 @@ int FastROMFile::tell()
 
 int FastROMFile::eof()
 {
-  if (modeRead) return (readPos == fs->GetFileEntryLen(fileIdx)) ? true : false;
+  FASTROMFS_LOCK_SHARED(fs);
+  if (modeRead) return (readPos == DataLen()) ? true : false;
   return false;  //TODO...what does eof() on a writable only file mean?
 }
 
 size_t FastROMFile::write(const uint8_t *out, size_t size)
 {
-  if (!size || !out || !modeWrite) return 0;
+  FASTROMFS_TIME_OP(fs, FASTROMFS_OP_WRITE, -1);
+  FastROMFSIOVec iov = { const_cast<uint8_t*>(out), size };
+  size_t ret = WriteV(&iov, 1);
+  FASTROMFS_TRACE_CALL(fs, FASTROMFS_TRACE_WRITE, this, 1, size, ret);
+  return ret;
+}
+
+size_t FastROMFile::writev(const FastROMFSIOVec *iov, int iovcnt)
+{
+  FASTROMFS_TIME_OP(fs, FASTROMFS_OP_WRITE, -1);
+  size_t ret = WriteV(iov, iovcnt);
+#if FASTROMFS_TRACE
+  size_t total = 0;
+  for (int i = 0; iov && (i < iovcnt); i++) total += iov[i].len;
+  fs->Trace(FASTROMFS_TRACE_WRITE, this, iovcnt, total, ret);
+#endif
+  return ret;
+}
+
+// Gather write.  The sector position is checked once up front and the directory length only updated at the end,
+// so a header + payload + trailer record costs the same bookkeeping as a single write().
+size_t FastROMFile::WriteV(const FastROMFSIOVec *iov, int iovcnt)
+{
+  if (!iov || (iovcnt <= 0) || !modeWrite) return 0;
+  size_t totalBytes = 0;
+  for (int i = 0; i < iovcnt; i++) {
+    if (!iov[i].base && iov[i].len) return 0;
+    totalBytes += iov[i].len;
+  }
+  if (!totalBytes) return 0;
+  FASTROMFS_LOCK_EXCLUSIVE(fs);
+  if (shared->fileIdx != fileIdx) return 0; // Unlinked out from under us
+  fs->StartBudget();
   size_t writtenBytes = 0;
 
+  // Below the head the walk would never find writePos and extend the chain until the disk is full
+  writePos = max(writePos, fs->GetFileEntryHead(fileIdx));
+  // Offsets never re-base, so a log that's appended ~2GB in total is full even if trimmed
+  if ((writePos > MAXFILEOFFSET) || (totalBytes > (size_t)(MAXFILEOFFSET - writePos))) return 0;
   // Make sure we're writing somewhere within the current sector
-  if (! ( (curWriteSectorOffset <= writePos) && ((curWriteSectorOffset + SECTORSIZE) > writePos) ) ) {
-    if (dataDirty) {
-      if (!fs->EraseSector(curWriteSector)) return 0;
-      if (!fs->WriteSector(curWriteSector, data)) return 0;
-    }
+  if (! ( (shared->curWriteSectorOffset <= writePos) && ((shared->curWriteSectorOffset + SECTORSIZE) > writePos) ) ) {
+    if (!FlushData()) return 0;
+    // Extending relinks the last sector, which a clone may share
+    if (fs->UnshareChain(fileIdx, (writePos - fs->GetFileEntryHead(fileIdx)) / SECTORSIZE) < 0) return 0;
     // Traverse the FAT table, optionally extending the file
-    curWriteSector = fs->GetFileEntryFAT(fileIdx);
-    curWriteSectorOffset = 0;
+    shared->curWriteSector = fs->GetFileEntryFAT(fileIdx);
+    shared->curWriteSectorOffset = fs->GetFileEntryHead(fileIdx);
     int lastSector = -1; // Used to update file links
-    while (! ( (curWriteSectorOffset <= writePos) && ((curWriteSectorOffset + SECTORSIZE) > writePos) ) ) {
-      lastSector = curWriteSector;
-      if (fs->GetFAT(curWriteSector) == FATEOF) { // Need to extend
+    while (! ( (shared->curWriteSectorOffset <= writePos) && ((shared->curWriteSectorOffset + SECTORSIZE) > writePos) ) ) {
+      lastSector = shared->curWriteSector;
+      if (fs->GetFAT(shared->curWriteSector) == FATEOF) { // Need to extend
         int newSector = fs->FindFreeSector();
         if (newSector < 0) return 0; // Out of space
-        fs->SetFAT(curWriteSector, newSector);
+        fs->SetFAT(shared->curWriteSector, newSector);
         fs->SetFAT(newSector, FATEOF);
-        curWriteSector = newSector;
-        memset(data, 0, SECTORSIZE);
-        if (!fs->EraseSector(curWriteSector)) return 0;
-        if (!fs->WriteSector(curWriteSector, data)) return 0;
+        shared->curWriteSector = newSector;
+        memset(shared->data, 0, SECTORSIZE);
+        if (!fs->ProgramSector(shared->curWriteSector, shared->data)) return 0;
       } else {
-        curWriteSector = fs->GetFAT(curWriteSector);
-      }
-      curWriteSectorOffset += SECTORSIZE;
-    }
-    if (fs->GetFileEntryLen(fileIdx) > curWriteSectorOffset) { // Read in old data
-      if (!fs->ReadSector(curWriteSector, data)) return 0;
-      // Try and allocate a new sector to write the updated data, update the FAT links
-      int newSector = fs->FindFreeSector();
-      if (newSector > 0) {
-        if (lastSector==-1) {
-          int nextSector = fs->GetFAT(fs->GetFileEntryFAT(fileIdx));
-          fs->SetFileEntryFAT(fileIdx, newSector);
-          fs->SetFAT(newSector, nextSector);
-        } else {
-          int nextSector = fs->GetFAT(curWriteSector);
-          fs->SetFAT(lastSector, newSector);
-          fs->SetFAT(newSector, nextSector);
-        }
-        dataDirty = true; // We definitely need to rewrite, no matter what happens later on
-        fs->SetFAT(curWriteSector, 0); // Free original block
-        curWriteSector = newSector;
-      } else {
-        // No space, just leave it where it is...
+        shared->curWriteSector = fs->GetFAT(shared->curWriteSector);
       }
+      shared->curWriteSectorOffset += SECTORSIZE;
+    }
+    if (fs->GetFileEntryLen(fileIdx) > shared->curWriteSectorOffset) { // Read in old data, it moves (or not) on flush
+      if (!LoadData(shared->curWriteSector, lastSector)) return 0;
     } else { // New sector...
-      memset(data, 0, SECTORSIZE);
+      NewData(shared->curWriteSector, lastSector);
     }
-    fs->SetFileEntryLen(fileIdx, max(fs->GetFileEntryLen(fileIdx), curWriteSectorOffset));
+    fs->SetFileEntryLen(fileIdx, max(fs->GetFileEntryLen(fileIdx), shared->curWriteSectorOffset));
   }
 
   // We're in the correct sector.  Start writing and extending/overwriting
-  while (size) {
-    int amountWritableInThisSector = min((int)size, (int)(SECTORSIZE - (writePos % SECTORSIZE)));
-    if (writePos >= curWriteSectorOffset + SECTORSIZE) amountWritableInThisSector = 0;
-    if (amountWritableInThisSector == 0) {
-      if (dataDirty) { // need to flush this sector
-        if (!fs->EraseSector(curWriteSector)) return 0;
-        if (!fs->WriteSector(curWriteSector, data)) return 0;
-        dataDirty = false;
-      }
-      if (fs->GetFAT(curWriteSector) != FATEOF) { // Update - read in old data
-        curWriteSector = fs->GetFAT(curWriteSector);
-        if (!fs->ReadSector(curWriteSector, data)) return 0;
-      } else { // Extend the file
-        int newSector = fs->FindFreeSector();
-        if (newSector < 0) return 0; // Out of space
-        fs->SetFAT(curWriteSector, newSector);
-        curWriteSector = newSector;
-        fs->SetFAT(newSector, FATEOF);
+  bool ok = true;
+  bool budgetStop = false;
+  for (int i = 0; ok && !budgetStop && (i < iovcnt); i++) {
+    const uint8_t *out = reinterpret_cast<const uint8_t*>(iov[i].base);
+    size_t size = iov[i].len;
+    while (size) {
+      int amountWritableInThisSector = min((int)size, (int)(SECTORSIZE - (writePos % SECTORSIZE)));
+      if (writePos >= shared->curWriteSectorOffset + SECTORSIZE) amountWritableInThisSector = 0;
+      if (amountWritableInThisSector == 0) {
+        if (!FlushData()) { // need to flush this sector
+          ok = false;
+          break;
+        }
+        if (fs->GetFAT(shared->curWriteSector) != FATEOF) { // Update - read in old data
+          if (!LoadData(fs->GetFAT(shared->curWriteSector), shared->curWriteSector)) {
+            ok = false;
+            break;
+          }
+        } else { // Extend the file
+          int newSector = fs->FindFreeSector();
+          if (newSector < 0) { // Out of space
+            ok = false;
+            break;
+          }
+          fs->SetFAT(shared->curWriteSector, newSector);
+          fs->SetFAT(newSector, FATEOF);
+          NewData(newSector, shared->curWriteSector);
+        }
+        shared->curWriteSectorOffset = writePos;
+        amountWritableInThisSector = min(size, SECTORSIZE);
+        // Out of time, hand back a short count.  Stopping after the move means the next call carries on in this sector.
+        if (!fs->yieldHook && fs->BudgetSpent()) {
+          fs->stats.budgetStops++;
+          budgetStop = true;
+          break;
+        }
       }
-      curWriteSectorOffset = writePos;
-      amountWritableInThisSector = min(size, SECTORSIZE);
+      // By now either have writable space in old or new sector
+      UpdateData(writePos % SECTORSIZE, out, amountWritableInThisSector);
+      writePos += amountWritableInThisSector; // We wrote this little bit
+      writtenBytes += amountWritableInThisSector;
+      // Reduce bytes available to write, increment data pointer
+      size -= amountWritableInThisSector;
+      out += amountWritableInThisSector;
     }
-    // By now either have writable space in old or new sector
-    memcpy(&data[writePos % SECTORSIZE], out, amountWritableInThisSector);
-    dataDirty = true; // We need to flush this on close() or leaving the sector
-    writePos += amountWritableInThisSector; // We wrote this little bit
-    writtenBytes += amountWritableInThisSector;
-    if (!modeAppend) readPos = writePos;
-    fs->SetFileEntryLen(fileIdx, max(fs->GetFileEntryLen(fileIdx), writePos)); // Potentially we just extended the file
-    // Reduce bytes available to write, increment data pointer
-    size -= amountWritableInThisSector;
-    out = reinterpret_cast<const uint8_t*>(out) + amountWritableInThisSector;
   }
 
-  return writtenBytes;
+  if (!modeAppend) readPos = writePos;
+  fs->SetFileEntryLen(fileIdx, max(fs->GetFileEntryLen(fileIdx), writePos)); // Potentially we just extended the file
+  return ok ? writtenBytes : 0;
 }
 
 int FastROMFile::close()
 {
+  FASTROMFS_TIME_OP(fs, FASTROMFS_OP_CLOSE, -1);
+  FASTROMFS_TRACE_CALL(fs, FASTROMFS_TRACE_CLOSE, this, 0, 0, 0);
+  FASTROMFS_LOCK_EXCLUSIVE(fs);
+  fs->StartBudget();
   int ret = 0;
   DEBUG_FASTROMFS("close()\n");
   if (modeWrite || modeAppend) {
-    if (dataDirty) {
-      if (!fs->EraseSector(curWriteSector)) ret |= -1;
-      else ret |= fs->WriteSector(curWriteSector, data) ? 0 : -1;
-    }
-    dataDirty = false;
-    free(data);
-    data = NULL;
+    if (!FlushData()) ret = -1;
   }
-  delete this;
+  fs->CloseHandle(this);
   return ret;
 }
 
 
 int FastROMFile::sync()
 {
+  FASTROMFS_TIME_OP(fs, FASTROMFS_OP_SYNC, -1);
+  FASTROMFS_TRACE_CALL(fs, FASTROMFS_TRACE_SYNC, this, 0, 0, 0);
   if (!modeWrite && !modeAppend) return 0;
-  if (!dataDirty) return 0;
-  if (!fs->EraseSector(curWriteSector)) return -1;
-  if (!fs->WriteSector(curWriteSector, data)) return -1;
-  dataDirty = false;
+  FASTROMFS_LOCK_EXCLUSIVE(fs);
+  fs->StartBudget();
+  if (!shared->dataDirty) return fs->DrainWriteBehind() ? 0 : -1;
+  if (!FlushData()) return -1;
   return fs->FlushFAT();
 }
 
 int FastROMFile::read(void *in, int size)
 {
-  if (!modeRead || !in || !size) return 0;
+  FASTROMFS_TIME_OP(fs, FASTROMFS_OP_READ, -1);
+  int ret = 0;
+  if (size > 0) {
+    FastROMFSIOVec iov = { in, (size_t)size };
+    ret = ReadV(&iov, 1);
+  }
+  FASTROMFS_TRACE_CALL(fs, FASTROMFS_TRACE_READ, this, 1, size, ret);
+  return ret;
+}
+
+int FastROMFile::readv(const FastROMFSIOVec *iov, int iovcnt)
+{
+  FASTROMFS_TIME_OP(fs, FASTROMFS_OP_READ, -1);
+  int ret = ReadV(iov, iovcnt);
+#if FASTROMFS_TRACE
+  size_t total = 0;
+  for (int i = 0; iov && (i < iovcnt); i++) total += iov[i].len;
+  fs->Trace(FASTROMFS_TRACE_READ, this, iovcnt, total, ret);
+#endif
+  return ret;
+}
+
+// Scatter read, one EOF clamp and chain lookup for the whole list
+int FastROMFile::ReadV(const FastROMFSIOVec *iov, int iovcnt)
+{
+  if (!modeRead || !iov || (iovcnt <= 0)) return 0;
+  for (int i = 0; i < iovcnt; i++) {
+    if (!iov[i].base && iov[i].len) return 0;
+  }
+  if (compressed) return ZReadV(iov, iovcnt);
+  FASTROMFS_LOCK_SHARED(fs);
+  if (shared->fileIdx != fileIdx) return 0; // Unlinked out from under us
+  int readBytes = ReadChain(&readPos, iov, iovcnt);
+  if (!modeAppend) writePos = readPos;
+  return readBytes;
+}
 
-  int readableBytesInFile = fs->GetFileEntryLen(fileIdx) - readPos;
-  size = min(readableBytesInFile, size); // We can only read to the end of file...
-  if (size <= 0) return 0;
+// The bytes stored in the chain from *pos on, which moves past them.  Lock held by the caller.
+int FastROMFile::ReadChain(int32_t *pos, const FastROMFSIOVec *iov, int iovcnt)
+{
+  *pos = max(*pos, fs->GetFileEntryHead(fileIdx)); // The walk below starts at the head and could never find it
+  int readableBytesInFile = fs->GetFileEntryLen(fileIdx) - *pos; // We can only read to the end of file...
+  if (readableBytesInFile <= 0) return 0;
 
   int readBytes = 0;
 
+  // A writer relinked or freed part of the chain, so our cached sector may be stale
+  if (readChainGen != shared->chainGen) {
+    curReadSector = -1;
+    curReadSectorOffset = -SECTORSIZE;
+    readChainGen = shared->chainGen;
+  }
+
   // Make sure we're reading from somewhere in the current sector
-  if (! ( (curReadSectorOffset <= readPos) && ((curReadSectorOffset + SECTORSIZE) > readPos) ) ) {
+  if (! ( (curReadSectorOffset <= *pos) && ((curReadSectorOffset + SECTORSIZE) > *pos) ) ) {
     // Traverse the FAT table, optionally extending the file
     curReadSector = fs->GetFileEntryFAT(fileIdx);
-    curReadSectorOffset = 0;
-    while (! ( (curReadSectorOffset <= readPos) && ((curReadSectorOffset + SECTORSIZE) > readPos) ) ) {
+    curReadSectorOffset = fs->GetFileEntryHead(fileIdx);
+    while (! ( (curReadSectorOffset <= *pos) && ((curReadSectorOffset + SECTORSIZE) > *pos) ) ) {
       if (fs->GetFAT(curReadSector) == FATEOF) { // Oops, reading past EOF!
         return 0; // EOF!...this path shouldn't happen...
       } else {
@@ -916,43 +2874,243 @@ int FastROMFile::read(void *in, int size)
     }
   }
 
-  while (size) {
-    int offsetIntoData = readPos % SECTORSIZE; //= pointer into data[]
-    int amountReadableInThisSector = min(size, SECTORSIZE - (readPos % SECTORSIZE));
-    if (readPos >= curReadSectorOffset + SECTORSIZE) amountReadableInThisSector = 0;
-    if (amountReadableInThisSector == 0) {
-      if (curReadSector == FATEOF) { // end
-        return readBytes; // Hit EOF...again, should not happen ever
+  for (int i = 0; (i < iovcnt) && readableBytesInFile; i++) {
+    uint8_t *in = reinterpret_cast<uint8_t*>(iov[i].base);
+    int size = min(readableBytesInFile, (int)iov[i].len);
+    readableBytesInFile -= size;
+    while (size) {
+      int offsetIntoData = *pos % SECTORSIZE; //= pointer into data[]
+      int amountReadableInThisSector = min(size, SECTORSIZE - (*pos % SECTORSIZE));
+      if (*pos >= curReadSectorOffset + SECTORSIZE) amountReadableInThisSector = 0;
+      if (amountReadableInThisSector == 0) {
+        if (curReadSector == FATEOF) { // end
+          return readBytes; // Hit EOF...again, should not happen ever
+        } else {
+          curReadSector = fs->GetFAT(curReadSector);
+        }
+        curReadSectorOffset += SECTORSIZE;
+        amountReadableInThisSector = min(size, SECTORSIZE);
+      }
+      if (curReadSectorOffset == shared->curWriteSectorOffset) { // R-A-W from any handle on this file, so forward the data
+        memcpy(in, &shared->data[offsetIntoData], amountReadableInThisSector);
       } else {
-        curReadSector = fs->GetFAT(curReadSector);
+        if (!fs->ReadPartialSector(curReadSector, offsetIntoData, in, amountReadableInThisSector)) return 0;
       }
-      curReadSectorOffset += SECTORSIZE;
-      amountReadableInThisSector = min(size, SECTORSIZE);
+      *pos += amountReadableInThisSector;
+      size -= amountReadableInThisSector;
+      readBytes += amountReadableInThisSector;
+      in += amountReadableInThisSector;
     }
-    if (curReadSector == curWriteSector) { // R-A-W, so forward the data
-      memcpy(in, &data[offsetIntoData], amountReadableInThisSector);
-    } else {
-      if (!fs->ReadPartialSector(curReadSector, offsetIntoData, in, amountReadableInThisSector)) return 0;
+  }
+  return readBytes;
+}
+
+// Compressed files decode a block at a time into the shared buffer.  Readers take turns with it, so this locks exclusive.
+int FastROMFile::ZReadV(const FastROMFSIOVec *iov, int iovcnt)
+{
+  FASTROMFS_LOCK_EXCLUSIVE(fs);
+  if (shared->fileIdx != fileIdx) return 0; // Unlinked out from under us
+  int readBytes = 0;
+  for (int i = 0; i < iovcnt; i++) {
+    uint8_t *in = reinterpret_cast<uint8_t*>(iov[i].base);
+    int size = min((int)iov[i].len, rawLen - readPos);
+    while (size > 0) {
+      int blk = readPos / SECTORSIZE;
+      if ((shared->zBlock != blk) && !ZLoadBlock(blk)) return readBytes;
+      int off = readPos % SECTORSIZE;
+      int n = min(size, min(SECTORSIZE, rawLen - blk * SECTORSIZE) - off);
+      memcpy(in, shared->data + off, n);
+      in += n;
+      readPos += n;
+      size -= n;
+      readBytes += n;
     }
-    readPos += amountReadableInThisSector;
-    if (!modeAppend) writePos = readPos;
-    size -= amountReadableInThisSector;
-    readBytes += amountReadableInThisSector;
-    in = reinterpret_cast<char*>(in) + amountReadableInThisSector;
   }
+  writePos = readPos;
   return readBytes;
 }
 
+// Pull a block's compressed bytes through a small window and decode them into the shared buffer
+bool FastROMFile::ZLoadBlock(int blk)
+{
+  shared->zBlock = -1;
+  uint32_t where[2];
+  int32_t pos = sizeof(ZHeader) + blk * sizeof(where[0]);
+  FastROMFSIOVec iov = { where, sizeof(where) };
+  if (ReadChain(&pos, &iov, 1) != sizeof(where)) return false;
+  int left = where[1] - where[0];
+  int outLen = min(SECTORSIZE, rawLen - blk * SECTORSIZE);
+  uint8_t *out = shared->data;
+  pos = where[0];
+  if (left == outLen) { // Stored
+    iov.base = out;
+    iov.len = outLen;
+    if (ReadChain(&pos, &iov, 1) != outLen) return false;
+    shared->zBlock = blk;
+    return true;
+  }
+  uint8_t in[256];
+  int have = 0, at = 0;
+  int o = 0;
+  while (o < outLen) {
+    if ((have - at < 1 + 8 * 2) && left) { // Room for a whole flag group
+      memmove(in, in + at, have - at);
+      have -= at;
+      at = 0;
+      iov.base = in + have;
+      iov.len = min(left, (int)sizeof(in) - have);
+      int got = ReadChain(&pos, &iov, 1);
+      if (got <= 0) return false;
+      have += got;
+      left -= got;
+    }
+    if (at >= have) return false;
+    uint8_t flags = in[at++];
+    for (int bit = 0; (bit < 8) && (o < outLen); bit++, flags >>= 1) {
+      if (flags & 1) {
+        if (at >= have) return false;
+        out[o++] = in[at++];
+      } else {
+        if (at + 2 > have) return false;
+        int dist = (in[at] | ((in[at + 1] & 0x0f) << 8)) + 1;
+        int len = (in[at + 1] >> 4) + ZMINMATCH;
+        at += 2;
+        if ((dist > o) || (o + len > outLen)) return false; // Corrupt
+        for (int i = 0; i < len; i++, o++) out[o] = out[o - dist]; // Overlapping copies repeat, like they should
+      }
+    }
+  }
+  shared->zBlock = blk;
+  return true;
+}
+
+// Next chunk for sendTo(), cut so chunks after the first start on bufSize boundaries and hit the aligned read path
+int FastROMFile::SendFill(uint8_t *buf, int bufSize, int left)
+{
+  int n = bufSize - (readPos % bufSize);
+  if (n > left) n = left;
+  FastROMFSIOVec iov = { buf, (size_t)n };
+  int got = ReadV(&iov, 1);
+  FASTROMFS_TRACE_CALL(fs, FASTROMFS_TRACE_READ, this, 1, n, got); // Replays as the plain read() it amounts to
+  return got;
+}
+
+// One buffer drains into dst while the other waits, full.  Whenever dst says it has no room the empty one is refilled
+// from flash instead of blocking in write(), so against a slow socket the flash reads mostly disappear.  Sinks that
+// never report room still get one buffer read ahead before the first blocking write.
+int FastROMFile::sendTo(FastROMFSSink &dst, int len)
+{
+  if (!modeRead || !len) return 0;
+  int slot[2];
+  {
+    FASTROMFS_LOCK_EXCLUSIVE(fs);
+    slot[0] = fs->PoolAlloc(&fs->bufferUsed, FASTROMFS_MAX_WRITE_BUFFERS);
+    if (slot[0] < 0) return -1; // Already counted as exhausted
+    // Splitting the one buffer isn't a refusal, so don't let PoolAlloc() count it as one
+    slot[1] = fs->PoolFull(fs->bufferUsed, FASTROMFS_MAX_WRITE_BUFFERS) ? -1 : fs->PoolAlloc(&fs->bufferUsed, FASTROMFS_MAX_WRITE_BUFFERS);
+  }
+  uint8_t *buf[2];
+  int bufSize = SECTORSIZE;
+  buf[0] = reinterpret_cast<uint8_t*>(fs->bufferPool[slot[0]]);
+  if (slot[1] >= 0) {
+    buf[1] = reinterpret_cast<uint8_t*>(fs->bufferPool[slot[1]]);
+  } else {
+    bufSize = SECTORSIZE / 2;
+    buf[1] = buf[0] + bufSize;
+  }
+
+  int left = (len < 0) ? 0x7fffffff : len; // Not read from the file yet
+  int fill[2] = { 0, 0 }; // Bytes waiting in each buffer
+  int cur = 0, out = 0; // Draining buf[cur], out of it already sent
+  int sent = 0;
+  bool more = true; // EOF not seen
+  while (1) {
+    if (out == fill[cur]) {
+      fill[cur] = 0;
+      out = 0;
+      if (fill[cur ^ 1]) {
+        cur ^= 1;
+        continue;
+      }
+      if (!more || (left <= 0)) break;
+      int got = SendFill(buf[cur], bufSize, left);
+      if (got <= 0) break;
+      fill[cur] = got;
+      left -= got;
+      continue;
+    }
+    int room = dst.availableForWrite();
+    if ((room < fill[cur] - out) && (room < SENDMINWRITE)) room = 0; // A sliver of room would only go out as a runt packet
+    if ((room <= 0) && !fill[cur ^ 1] && more && (left > 0)) {
+      int got = SendFill(buf[cur ^ 1], bufSize, left);
+      if (got > 0) {
+        fill[cur ^ 1] = got;
+        left -= got;
+        fs->stats.sendReadAheads++;
+      } else {
+        more = false;
+      }
+      continue;
+    }
+    int n = fill[cur] - out;
+    if ((room > 0) && (room < n)) n = room;
+    int w = dst.write(buf[cur] + out, n);
+    if (w <= 0) break; // Connection dropped
+    out += w;
+    sent += w;
+  }
+  // Whatever was read but never sent goes back, so the caller can pick up from what the far end really got
+  int unsent = (fill[cur] - out) + fill[cur ^ 1];
+  if (unsent) {
+    readPos -= unsent;
+    if (!modeAppend) writePos = readPos;
+    FASTROMFS_TRACE_CALL(fs, FASTROMFS_TRACE_SEEK, this, SEEK_CUR, -unsent, 0);
+  }
+
+  FASTROMFS_LOCK_EXCLUSIVE(fs);
+  fs->PoolFree(&fs->bufferUsed, slot[0]);
+  if (slot[1] >= 0) fs->PoolFree(&fs->bufferUsed, slot[1]);
+  return sent;
+}
+
+bool FastROMFile::truncate(int len)
+{
+  FASTROMFS_TRACE_CALL(fs, FASTROMFS_TRACE_TRUNCATE, this, 0, len, 0);
+  if (!modeWrite) return false;
+  FASTROMFS_LOCK_EXCLUSIVE(fs);
+  if (shared->fileIdx != fileIdx) return false; // Unlinked out from under us
+  return fs->TruncateFileEntry(fileIdx, len);
+}
+
+int FastROMFile::trim(int off)
+{
+  FASTROMFS_TRACE_CALL(fs, FASTROMFS_TRACE_TRIM, this, 0, off, 0);
+  if (!modeWrite) return -1;
+  FASTROMFS_LOCK_EXCLUSIVE(fs);
+  if (shared->fileIdx != fileIdx) return -1; // Unlinked out from under us
+  return fs->TrimFileEntry(fileIdx, off);
+}
+
+int FastROMFile::head()
+{
+  FASTROMFS_LOCK_SHARED(fs);
+  return fs->GetFileEntryHead(fileIdx);
+}
+
 bool FastROMFile::seek(int off, int whence)
 {
+  FASTROMFS_TIME_OP(fs, FASTROMFS_OP_SEEK, -1);
+  FASTROMFS_TRACE_CALL(fs, FASTROMFS_TRACE_SEEK, this, whence, off, 0);
+  FASTROMFS_LOCK_SHARED(fs);
   int absolutePos; // = offset we want to seek to from start of file
   switch (whence) {
     case SEEK_SET: absolutePos = off; break;
     case SEEK_CUR: absolutePos = readPos + off; break;
-    case SEEK_END: absolutePos = fs->GetFileEntryLen(fileIdx) + off; break;
+    case SEEK_END: absolutePos = DataLen() + off; break;
     default: return false;
   }
   if (absolutePos < 0) return -1; // Can't seek before beginning of file
+  absolutePos = max(absolutePos, fs->GetFileEntryHead(fileIdx)); // Trimmed logs start at their head
   if (modeAppend) {
     if (!modeRead) return -1; // seeks not allowed on append
   } else {
@@ -961,3 +3119,310 @@ bool FastROMFile::seek(int off, int whence)
   }
   return true;
 }
+
+
+#define FASTROMKV_PUT 0
+#define FASTROMKV_DELETE 1
+
+FastROMKV::FastROMKV()
+{
+  fs = NULL;
+  pin = NULL;
+  fileIdx = -1;
+  keys = 0;
+  memset(index, 0, sizeof(index));
+}
+
+FastROMKV::~FastROMKV()
+{
+  end();
+}
+
+// FNV-1a, never 0 since that marks an empty slot
+uint32_t FastROMKV::Hash(const char *key, int keyLen)
+{
+  uint32_t h = 2166136261UL;
+  for (int i = 0; i < keyLen; i++) {
+    h ^= (uint8_t)key[i];
+    h *= 16777619UL;
+  }
+  return h ? h : 1;
+}
+
+// Slot holding this key, or -1.  Only a full hash match costs a flash read, to make sure it's really our key.
+int FastROMKV::Find(const char *key, int keyLen, uint32_t hash)
+{
+  for (int i = hash & (FASTROMKV_INDEX_SIZE - 1); index[i].hash; i = (i + 1) & (FASTROMKV_INDEX_SIZE - 1)) {
+    if (index[i].hash != hash) continue;
+    uint32_t rec[(sizeof(Header) + FASTROMKV_MAXKEY) / 4];
+    Header *h = reinterpret_cast<Header*>(rec);
+    if (!fs->ReadPartialSector(index[i].sector, SlotOffset(i), rec, sizeof(Header) + keyLen)) return -1;
+    if ((h->keyLen == keyLen) && !memcmp(rec + sizeof(Header) / 4, key, keyLen)) return i;
+  }
+  return -1;
+}
+
+void FastROMKV::Insert(uint32_t hash, int sector, int offset, int size)
+{
+  int i = hash & (FASTROMKV_INDEX_SIZE - 1);
+  while (index[i].hash) i = (i + 1) & (FASTROMKV_INDEX_SIZE - 1);
+  index[i].hash = hash;
+  Point(i, sector, offset, size);
+  liveBytes += size;
+  keys++;
+}
+
+// Backward-shift delete, so lookups never need tombstones in RAM
+void FastROMKV::Erase(int slot)
+{
+  liveBytes -= SlotSize(slot);
+  keys--;
+  int hole = slot;
+  for (int i = (slot + 1) & (FASTROMKV_INDEX_SIZE - 1); index[i].hash; i = (i + 1) & (FASTROMKV_INDEX_SIZE - 1)) {
+    int home = index[i].hash & (FASTROMKV_INDEX_SIZE - 1);
+    // Move it back if its home isn't cyclically within (hole, i]
+    if (((i - home) & (FASTROMKV_INDEX_SIZE - 1)) >= ((i - hole) & (FASTROMKV_INDEX_SIZE - 1))) {
+      index[hole] = index[i];
+      hole = i;
+    }
+  }
+  index[hole].hash = 0;
+}
+
+bool FastROMKV::begin(FastROMFilesystem *fs, const char *name)
+{
+  end();
+  FASTROMFS_LOCK_EXCLUSIVE(fs);
+  if (!fs->fsIsMounted || !name) return false;
+  this->fs = fs;
+  fileIdx = fs->FindFileEntryByName(name);
+  if (fileIdx < 0) fileIdx = fs->CreateNewFileEntry(name);
+  if (fileIdx < 0) return false;
+  if (fs->clones) { // Records are programmed in place, so a clone can't keep sharing the log
+    fs->StartBudget();
+    if ((fs->UnshareChain(fileIdx, MAXFATENTRIES) < 0) || !fs->FlushFAT()) return false;
+  }
+  int head = fs->GetFileEntryHead(fileIdx);
+  if (fs->GetFileEntryLen(fileIdx) == head) {
+    // Brand new (or never got this far), the first sector may hold anything
+    fs->StartBudget();
+    if (!fs->EraseSector(fs->GetFileEntryFAT(fileIdx))) return false;
+    fs->SetFileEntryLen(fileIdx, head + SECTORSIZE);
+    if (!fs->FlushFAT()) return false;
+  }
+  // Holding it open keeps defrag() from moving our sectors out from under the index
+  pin = fs->OpenHandle(fileIdx, head, head, true, false, false, false);
+  if (!pin) return false;
+  if (!Scan()) {
+    fs->CloseHandle(pin);
+    pin = NULL;
+    return false;
+  }
+  DEBUG_FASTROMFS("FastROMKV::begin('%s') %d keys, %d live bytes in %d sectors\n", name, keys, liveBytes, sectors);
+  return true;
+}
+
+// Replay every record oldest to newest.  Anything that isn't a whole valid record ends its sector, and if that's
+// the last sector nothing more goes in it, so a torn put() is simply ignored.
+bool FastROMKV::Scan()
+{
+  memset(index, 0, sizeof(index));
+  keys = 0;
+  liveBytes = 0;
+  sectors = 0;
+  uint32_t rec[FASTROMKV_MAXRECORD / 4];
+  Header *h = reinterpret_cast<Header*>(rec);
+  const char *key = reinterpret_cast<const char*>(rec + sizeof(Header) / 4);
+  for (int sec = fs->GetFileEntryFAT(fileIdx); (sec > 0) && (sec < fs->fs.md.sectors); sec = fs->GetFAT(sec)) {
+    sectors++;
+    tailSector = sec;
+    tailOff = 0;
+    while (tailOff + (int)sizeof(Header) <= SECTORSIZE) {
+      int len = min(FASTROMKV_MAXRECORD, SECTORSIZE - tailOff);
+      if (!fs->ReadPartialSector(sec, tailOff, rec, len)) return false;
+      if ((h->keyLen == 0xff) && (h->flags == 0xff) && (h->valLen == 0xffff) && (h->crc == 0xffffffff)) break;
+      int size = (sizeof(Header) + h->keyLen + h->valLen + 3) & ~3;
+      bool ok = (h->keyLen > 0) && (h->keyLen <= FASTROMKV_MAXKEY) && (h->flags <= FASTROMKV_DELETE) && (size <= len);
+      if (ok) {
+        uint32_t savedCRC = h->crc;
+        uint32_t calcCRC = 0;
+        h->crc = 0;
+        fs->CRC32(rec, sizeof(Header) + h->keyLen + h->valLen, &calcCRC);
+        ok = (savedCRC == calcCRC);
+      }
+      if (!ok) {
+        DEBUG_FASTROMFS("FastROMKV::Scan bad record at %d:%d, closing sector\n", sec, tailOff);
+        tailOff = SECTORSIZE;
+        break;
+      }
+      uint32_t hash = Hash(key, h->keyLen);
+      int slot = Find(key, h->keyLen, hash);
+      if (slot >= 0) Erase(slot);
+      if (h->flags == FASTROMKV_PUT) {
+        if (keys >= FASTROMKV_INDEX_SIZE * 3 / 4) return false; // Built with a bigger index than ours
+        Insert(hash, sec, tailOff, size);
+      }
+      tailOff += size;
+    }
+  }
+  if (!sectors) return false;
+  // The free space at the end has to really be erased or a put() there would program over junk
+  for (int off = tailOff & ~3; off < SECTORSIZE; off += FASTROMKV_MAXRECORD) {
+    int len = min(FASTROMKV_MAXRECORD, SECTORSIZE - off);
+    if (!fs->ReadPartialSector(tailSector, off, rec, len)) return false;
+    for (int i = 0; i < len / 4; i++) {
+      if (rec[i] != 0xffffffff) {
+        tailOff = SECTORSIZE;
+        break;
+      }
+    }
+  }
+  return true;
+}
+
+void FastROMKV::end()
+{
+  if (!pin) return;
+  FASTROMFS_LOCK_EXCLUSIVE(fs);
+  fs->CloseHandle(pin);
+  pin = NULL;
+}
+
+int FastROMKV::get(const char *key, void *value, int maxLen)
+{
+  if (!pin || !key || (maxLen < 0)) return -1;
+  int keyLen = strlen(key);
+  if (!keyLen || (keyLen > FASTROMKV_MAXKEY)) return -1;
+  FASTROMFS_LOCK_SHARED(fs);
+  uint32_t hash = Hash(key, keyLen);
+  // Same probe as Find(), but pull in the whole record on a hash hit so the common case is one read
+  for (int i = hash & (FASTROMKV_INDEX_SIZE - 1); index[i].hash; i = (i + 1) & (FASTROMKV_INDEX_SIZE - 1)) {
+    if (index[i].hash != hash) continue;
+    uint32_t rec[FASTROMKV_MAXRECORD / 4];
+    Header *h = reinterpret_cast<Header*>(rec);
+    if (!fs->ReadPartialSector(index[i].sector, SlotOffset(i), rec, SlotSize(i))) return -1;
+    if ((h->keyLen != keyLen) || memcmp(rec + sizeof(Header) / 4, key, keyLen)) continue;
+    if (value) memcpy(value, reinterpret_cast<uint8_t*>(rec) + sizeof(Header) + keyLen, min(maxLen, (int)h->valLen));
+    return h->valLen;
+  }
+  return -1;
+}
+
+// Start a fresh tail sector.  Erased before it's linked in, so a crash never leaves junk at the end of the chain.
+bool FastROMKV::NewSector()
+{
+  int sec = fs->FindFreeSector();
+  if (sec < 0) return false;
+  if (!fs->EraseSector(sec)) return false;
+  fs->SetFAT(sec, FATEOF);
+  fs->SetFAT(tailSector, sec);
+  sectors++;
+  fs->SetFileEntryLen(fileIdx, fs->GetFileEntryLen(fileIdx) + SECTORSIZE);
+  if (!fs->FlushFAT()) return false;
+  tailSector = sec;
+  tailOff = 0;
+  return true;
+}
+
+bool FastROMKV::Append(const char *key, int keyLen, uint32_t hash, uint8_t flags, const void *value, int len)
+{
+  int size = (sizeof(Header) + keyLen + len + 3) & ~3;
+  if (size > FASTROMKV_MAXRECORD) return false;
+  if (fs->clones) { // Cloned since begin(), copy before writing and find out where everything went
+    uint32_t gen = fs->FindShared(fileIdx)->chainGen;
+    if ((fs->UnshareChain(fileIdx, MAXFATENTRIES) < 0) || !fs->FlushFAT()) return false;
+    if ((fs->FindShared(fileIdx)->chainGen != gen) && !Scan()) return false;
+  }
+  int slot = Find(key, keyLen, hash);
+  if ((slot < 0) && (flags == FASTROMKV_DELETE)) return false; // Nothing to delete
+  if ((slot < 0) && (keys >= FASTROMKV_INDEX_SIZE * 3 / 4)) return false; // Index is full
+
+  uint32_t rec[FASTROMKV_MAXRECORD / 4];
+  memset(rec, 0xff, size);
+  Header *h = reinterpret_cast<Header*>(rec);
+  h->keyLen = keyLen;
+  h->flags = flags;
+  h->valLen = len;
+  h->crc = 0;
+  memcpy(rec + sizeof(Header) / 4, key, keyLen);
+  if (len) memcpy(reinterpret_cast<uint8_t*>(rec) + sizeof(Header) + keyLen, value, len);
+  uint32_t crc = 0;
+  fs->CRC32(rec, sizeof(Header) + keyLen + len, &crc);
+  h->crc = crc;
+
+  if ((tailOff + size > SECTORSIZE) && !NewSector()) {
+    // Full, see if reclaiming the oldest sector makes room and go around once more
+    if ((sectors < 2) || !CompactOne() || ((tailOff + size > SECTORSIZE) && !NewSector())) return false;
+  }
+  if (!fs->ProgramPartialSector(tailSector, tailOff, rec, size)) return false;
+  if (flags == FASTROMKV_DELETE) {
+    Erase(slot);
+  } else if (slot >= 0) {
+    liveBytes += size - SlotSize(slot);
+    Point(slot, tailSector, tailOff, size);
+  } else {
+    Insert(hash, tailSector, tailOff, size);
+  }
+  tailOff += size;
+  return true;
+}
+
+// Copy the oldest sector's live records to the tail and drop it off the head of the file
+bool FastROMKV::CompactOne()
+{
+  int oldest = fs->GetFileEntryFAT(fileIdx);
+  if (oldest == tailSector) return false;
+  uint32_t rec[FASTROMKV_MAXRECORD / 4];
+  for (int i = 0; i < FASTROMKV_INDEX_SIZE; i++) {
+    if (!index[i].hash || (index[i].sector != oldest)) continue;
+    int size = SlotSize(i);
+    if (!fs->ReadPartialSector(oldest, SlotOffset(i), rec, size)) return false;
+    if ((tailOff + size > SECTORSIZE) && !NewSector()) return false;
+    if (!fs->ProgramPartialSector(tailSector, tailOff, rec, size)) return false;
+    Point(i, tailSector, tailOff, size); // Same key, same slot, the probe order doesn't change
+    tailOff += size;
+  }
+  if (fs->TrimFileEntry(fileIdx, fs->GetFileEntryHead(fileIdx) + SECTORSIZE) < 0) return false;
+  sectors--;
+  return true;
+}
+
+bool FastROMKV::put(const char *key, const void *value, int len)
+{
+  if (!pin || !key || (len < 0) || (len && !value)) return false;
+  int keyLen = strlen(key);
+  if (!keyLen || (keyLen > FASTROMKV_MAXKEY)) return false;
+  FASTROMFS_LOCK_EXCLUSIVE(fs);
+  if (!fs->fsIsMounted) return false;
+  fs->StartBudget();
+  return Append(key, keyLen, Hash(key, keyLen), FASTROMKV_PUT, value, len);
+}
+
+bool FastROMKV::remove(const char *key)
+{
+  if (!pin || !key) return false;
+  int keyLen = strlen(key);
+  if (!keyLen || (keyLen > FASTROMKV_MAXKEY)) return false;
+  FASTROMFS_LOCK_EXCLUSIVE(fs);
+  if (!fs->fsIsMounted) return false;
+  fs->StartBudget();
+  return Append(key, keyLen, Hash(key, keyLen), FASTROMKV_DELETE, NULL, 0);
+}
+
+int FastROMKV::count()
+{
+  return pin ? keys : 0;
+}
+
+// Worth doing once the dead records add up to at least a whole sector
+bool FastROMKV::compact(int maxSectors)
+{
+  if (!pin) return false;
+  FASTROMFS_LOCK_EXCLUSIVE(fs);
+  if (!fs->fsIsMounted) return false;
+  fs->StartBudget();
+  for (int i = 0; (i < maxSectors) && (Garbage() >= SECTORSIZE) && (sectors > 1); i++) {
+    if (!CompactOne()) return false;
+  }
+  return (Garbage() >= SECTORSIZE) && (sectors > 1);
+}
@@ -26,6 +26,98 @@
   #define DEBUGFASTROMFS 0
 #endif
 
+// Host only, check every misaligned ReadPartialSector() against a plain memcpy, set to 1
+#ifndef FASTROMFS_VERIFY_READS
+  #define FASTROMFS_VERIFY_READS 0
+#endif
+
+// Enable reader/writer locking so multiple tasks can share one filesystem, set to 1
+// Lookups and reads run concurrently, anything touching metadata or flash contents is exclusive
+#ifndef FASTROMFS_THREADSAFE
+  #define FASTROMFS_THREADSAFE 0
+#endif
+
+// Queue dirty sectors and program them in the background instead of blocking write()/sync()/close(), set to 1
+// On the host a worker thread drains the queue, on the ESP8266 call pump() from loop()
+#ifndef FASTROMFS_WRITEBEHIND
+  #define FASTROMFS_WRITEBEHIND 0
+#endif
+// Each queued sector costs a 4KB buffer
+#ifndef FASTROMFS_WRITEBEHIND_DEPTH
+  #define FASTROMFS_WRITEBEHIND_DEPTH 2
+#endif
+
+// How many free sectors idle() tries to keep erased, so allocation only has to program
+#ifndef FASTROMFS_PREERASE_DEPTH
+  #define FASTROMFS_PREERASE_DEPTH 4
+#endif
+
+// Handles, write buffers and directory iterators come from fixed pools inside FastROMFilesystem instead of the heap.
+// open()/opendir() fail straight away once a pool is used up.  Each write buffer costs 4KB, at most 32 of anything.
+#ifndef FASTROMFS_MAX_OPEN_FILES
+  #define FASTROMFS_MAX_OPEN_FILES 8
+#endif
+#ifndef FASTROMFS_MAX_WRITE_BUFFERS
+  #define FASTROMFS_MAX_WRITE_BUFFERS 2
+#endif
+#ifndef FASTROMFS_MAX_OPEN_DIRS
+  #define FASTROMFS_MAX_OPEN_DIRS 2
+#endif
+#if (FASTROMFS_MAX_OPEN_FILES > 32) || (FASTROMFS_MAX_WRITE_BUFFERS > 32) || (FASTROMFS_MAX_OPEN_DIRS > 32)
+  #error FastROMFS pools are limited to 32 entries each
+#endif
+
+// Keep only the packed FAT and each file's start/length resident instead of the whole 4KB metadata sector, set to 1
+// File names stay on flash and are paged in when a lookup needs them, which frees about 1.8KB of RAM
+#ifndef FASTROMFS_LOWRAM
+  #define FASTROMFS_LOWRAM 0
+#endif
+// Low-RAM mode only, renamed entries held in RAM until the next metadata flush.  Running out forces a flush.
+#ifndef FASTROMFS_LOWRAM_NAMES
+  #define FASTROMFS_LOWRAM_NAMES 4
+#endif
+
+// Keep the FAT as a plain 16-bit array in RAM, only packing it to 12 bits on flush, set to 1.  Costs 2KB of RAM.
+#ifndef FASTROMFS_UNPACKEDFAT
+  #define FASTROMFS_UNPACKEDFAT 0
+#endif
+
+// Report every API call to a hook so field workloads can be captured and replayed with tools/fsreplay, set to 1
+#ifndef FASTROMFS_TRACE
+  #define FASTROMFS_TRACE 0
+#endif
+
+// Time flash operations and public calls into log2 latency histograms, plus an optional per-flash-op callback, set to 1
+// Costs about 1KB of RAM and two clock reads per timed operation
+#ifndef FASTROMFS_INSTRUMENT
+  #define FASTROMFS_INSTRUMENT 0
+#endif
+
+// Directory entries.  Past the 64 that fit in the metadata sector the rest live in their own chain of sectors, 128 to
+// a sector, rewritten on the metadata flush that changes them.  Every entry is kept in RAM (32 bytes each) along with a
+// hash index on the names.  Images work either way, a build with fewer entries just doesn't see the files past its limit.
+#ifndef FASTROMFS_MAX_FILES
+  #define FASTROMFS_MAX_FILES 64
+#endif
+#if FASTROMFS_MAX_FILES < 64
+  #error FASTROMFS_MAX_FILES has to at least cover the 64 entries in the metadata sector
+#endif
+#if FASTROMFS_MAX_FILES > 1024
+  #error Every file needs at least one of the 1024 sectors
+#endif
+#if FASTROMFS_LOWRAM && (FASTROMFS_MAX_FILES > 64)
+  #error FASTROMFS_LOWRAM keeps names on flash, it has no room for a directory chain
+#endif
+
+// Slots in each FastROMKV's RAM index, a power of 2.  8 bytes each, holds up to 3/4 as many keys.
+#ifndef FASTROMKV_INDEX_SIZE
+  #define FASTROMKV_INDEX_SIZE 256
+#endif
+
+#if FASTROMFS_THREADSAFE || (FASTROMFS_WRITEBEHIND && !defined(ARDUINO))
+  #include <pthread.h>
+#endif
+
 // Constants that define filesystem structure
 #define FSMAGIC 0xdead0beef0f00dl
 #define SECTORSIZE 4096
@@ -34,11 +126,14 @@
 #define FATCOPIES 8
 #define NAMELEN 24
 #define MAXFATENTRIES 1024
+#define DIRENTRIES (SECTORSIZE / sizeof(FileEntry)) // Per directory chain sector
+#define DIRSECTORS ((FASTROMFS_MAX_FILES - FILEENTRIES + DIRENTRIES - 1) / DIRENTRIES)
 
 
 
 class FastROMFilesystem;
 class FastROMFile;
+class FastROMKV;
 
 typedef void FastROMFSDir; // Opaque for the masses
 
@@ -48,11 +143,94 @@ struct FastROMFSDirent {
   int len;
 };
 
+// One traced call, 16 bytes so a ring of them is cheap to keep on the device
+typedef struct {
+  uint8_t op; // FASTROMFS_TRACE_xxx
+  uint8_t handle; // Handle pool slot, 0xff for filesystem calls and failed opens
+  uint16_t arg; // Open mode, seek whence, iovec count or FASTROMFS_TRACE_BYTECALL
+  uint32_t time; // Microseconds, wraps
+  int32_t a; // Size, offset or name hash.  Names themselves aren't recorded.
+  int32_t b; // Result, or the second name hash of a rename
+} FastROMFSTraceRecord;
+
+typedef void (*FastROMFSTraceHook)(const FastROMFSTraceRecord *rec, void *arg);
+
+#define FASTROMFS_TRACE_MOUNT 1
+#define FASTROMFS_TRACE_UMOUNT 2
+#define FASTROMFS_TRACE_OPEN 3 // arg = mode[0] | 0x100 if '+'
+#define FASTROMFS_TRACE_CLOSE 4
+#define FASTROMFS_TRACE_READ 5
+#define FASTROMFS_TRACE_WRITE 6
+#define FASTROMFS_TRACE_PEEK 7
+#define FASTROMFS_TRACE_SEEK 8
+#define FASTROMFS_TRACE_SYNC 9
+#define FASTROMFS_TRACE_UNLINK 10
+#define FASTROMFS_TRACE_RENAME 11
+#define FASTROMFS_TRACE_IDLE 12
+#define FASTROMFS_TRACE_TRUNCATE 13 // By name: a = name hash, b = length.  On a handle: a = length.
+#define FASTROMFS_TRACE_TRIM 14 // Same args as TRUNCATE, with the requested offset
+#define FASTROMFS_TRACE_CLONE 15 // a = source name hash, b = new name hash
+#define FASTROMFS_TRACE_OPS 16 // One past the highest op
+#define FASTROMFS_TRACE_BYTECALL 0xffff // arg for single byte Stream read()/write()
+
+// Timed operation types for getLatency() and the flash op hook
+#define FASTROMFS_OP_ERASE 0 // EraseSector() that reached the flash
+#define FASTROMFS_OP_PROGRAM 1 // WriteSector() or an in-place ProgramPartialSector()
+#define FASTROMFS_OP_FLASHREAD 2 // ReadSector() or ReadPartialSector()
+#define FASTROMFS_OP_FLUSHFAT 3
+#define FASTROMFS_OP_OPEN 4
+#define FASTROMFS_OP_CLOSE 5
+#define FASTROMFS_OP_READ 6 // read()/readv(), single byte Stream calls only show up as the flash reads they cause
+#define FASTROMFS_OP_WRITE 7 // write()/writev(), same for single bytes
+#define FASTROMFS_OP_SEEK 8
+#define FASTROMFS_OP_SYNC 9
+#define FASTROMFS_OPS 10
+
+// Bucket 0 is under 2us, bucket N covers [2^N, 2^(N+1)) us, and the last one everything from 2^19us (~0.5s) up
+#define FASTROMFS_LATENCY_BUCKETS 20
+
+typedef struct {
+  uint32_t count;
+  uint32_t maxUs;
+  uint64_t totalUs;
+  uint32_t p50Us; // Upper edge of the bucket holding the median, filled in by getLatency()
+  uint32_t p99Us; // Same for the 99th percentile, never more than maxUs
+  uint32_t bucket[FASTROMFS_LATENCY_BUCKETS];
+} FastROMFSLatency;
+
+// Called after every timed flash op (ERASE, PROGRAM, FLASHREAD, FLUSHFAT) with the filesystem locked,
+// possibly from the write-behind thread.  Must not call back into the filesystem.
+typedef void (*FastROMFSFlashOpHook)(int op, int sector, uint32_t us, void *arg);
+
+// Called between flash operations once a call has used up its setWriteBudget() allowance, with the filesystem locked.
+// On the ESP8266 this is the place for yield() or feeding the watchdog.  Must not call back into the filesystem.
+typedef void (*FastROMFSYieldHook)(void *arg);
+
+// One buffer of a FastROMFile::readv()/writev() list
+struct FastROMFSIOVec {
+  void *base;
+  size_t len;
+};
+
+// Where FastROMFile::sendTo() copies to.  Any Print (Serial, WiFiClient...) on the ESP8266, on the host anything
+// implementing these two.
+#ifdef ARDUINO
+typedef Print FastROMFSSink;
+#else
+class FastROMFSSink
+{
+  public:
+    virtual ~FastROMFSSink() {}
+    virtual size_t write(const uint8_t *buf, size_t size) = 0; // May block, 0 once the far end has gone away
+    virtual int availableForWrite() { return 0; } // What write() would take right now without blocking, 0 = full or don't know
+};
+#endif
+
 
 // Private structs
 typedef struct {
   char name[NAMELEN]; // Not necessarialy 0-terminated, beware!
-  int32_t fat; // Index to first FAT block. Only need 16 bits, but easiest to ensure alignment @32
+  int32_t fat; // Index to first FAT block in the low 12 bits, whole sectors trimmed off the front of the file above that
   int32_t len; // Can be 0 if file just created with no writes
 } FileEntry;
 
@@ -65,13 +243,206 @@ typedef union {
     uint32_t crc; // CRC32 over the complete entry (replace with 0 before calc'ing)
     FileEntry fileEntry[ FILEENTRIES ];
     uint8_t fat[ (MAXFATENTRIES * 12) / 8 ]; // 12-bit packed, use accessors to get in here!  
+    int32_t dirSector; // First sector of the directory chain holding entries past FILEENTRIES, none unless >= FATCOPIES
   } md; // MetaData
 } FilesystemInFlash;
 
+#if FASTROMFS_LOWRAM
+typedef struct {
+  int32_t fat;
+  int32_t len;
+} FileEntryInRAM;
+
+// The parts of FilesystemInFlash that stay in RAM in low-RAM mode, same field names so most code doesn't care
+typedef struct {
+  struct {
+    uint64_t magic;
+    int64_t epoch;
+    int32_t sectors;
+    uint32_t crc;
+    FileEntryInRAM fileEntry[ FILEENTRIES ]; // Names live on flash, see nameHash[]
+    uint8_t fat[ (MAXFATENTRIES * 12) / 8 ];
+    int32_t dirSector; // Only carried through, low-RAM builds don't read the chain
+  } md;
+} FilesystemInRAM;
+#else
+typedef FileEntry FileEntryInRAM;
+#endif
+
+// Open state shared by every FastROMFile handle on the same entry, so readers see unflushed writes
+typedef struct FastROMFileShared {
+  struct FastROMFileShared *next; // List of open files in this filesystem
+  int fileIdx; // Which entry, -1 once unlinked out from under its handles
+  int refs; // Number of handles using this
+  uint8_t *data; // = sector data.  On update, read old sector into it.  Only allocated once a writer opens
+  bool dataDirty; // = flag the data here is dirty
+  int32_t curWriteSector; // = current sector in buffer
+  int32_t curWriteSectorOffset; // = offset of byte[0] of the current sector in the file
+  int32_t prevWriteSector; // = sector linking to curWriteSector, -1 if it's the first
+  bool cowPending; // = buffer holds a sector loaded from flash that hasn't been relocated yet
+  bool clearOnly; // = every change since loading only cleared bits, so it can be programmed in place
+  int16_t dirtyLo; // = first byte changed since loading
+  int16_t dirtyHi; // = one past the last byte changed since loading
+  uint32_t chainGen; // = bumped whenever sectors in the chain are relinked or freed, so readers re-walk
+  uint32_t dataGen; // = bumped on every change to the file's contents, invalidates handles' read lines
+  int32_t zBlock; // = compressed files only, which block is decoded in data, -1 = none
+} FastROMFileShared;
+
+typedef struct {
+  uint32_t sectorErases; // Erases that actually hit the flash
+  uint32_t sectorWrites; // Full sector programs
+  uint32_t preErases; // Erases done ahead of time by idle()
+  uint32_t preEraseHits; // Erase requests satisfied by an already erased sector
+  uint32_t preEraseMisses; // Erase requests that had to wait for the flash
+  uint32_t inPlaceUpdates; // r+ sector flushes that only cleared bits and were programmed in place
+  uint32_t bytesRead; // Read from flash, buffer and write-behind queue hits don't count
+  uint32_t bytesProgrammed; // Full sector writes plus partial in-place programs
+  uint32_t poolExhausted; // open()/opendir() calls refused because a handle, buffer or iterator pool was empty
+  uint32_t budgetStops; // write() calls that returned a short count because the write budget ran out
+  uint32_t budgetYields; // Times the yield hook was called
+  uint32_t defragMoves; // Sectors relocated by defrag()
+  uint32_t sendReadAheads; // sendTo() buffers filled from flash while the destination had no room
+  int preErasePool; // Free sectors currently known to be erased
+} FastROMFSStats;
+
+
+#ifdef ARDUINO
+class FastROMFile : public Stream
+#else
+#define override
+class FastROMFile
+#endif
+{
+    friend class FastROMFilesystem;
+
+  public:
+    size_t write(const uint8_t *out, size_t size) override;
+    int read(void *data, int size);
+    size_t writev(const FastROMFSIOVec *iov, int iovcnt); // Write every buffer in order, as one call
+    int readv(const FastROMFSIOVec *iov, int iovcnt); // Fill every buffer in order, as one call
+    bool seek(int off, int whence);
+    bool seek(int off) {
+      return seek(off, SEEK_SET);
+    }
+    int close();
+    int tell();
+    int eof();
+    int size();
+    void name(char *buff, int buffLen);
+    int fputc(int c);
+    int fgetc();
+    int sync();
+    bool truncate(int len); // Shrink only, frees the sectors past the new end
+    // Circular logs: free the whole sectors before offset off and return the new head, -1 on error.  Offsets don't
+    // shift, reads and seeks below the head land on it, and the sector being appended to always stays.  Since they
+    // don't, writes that would take a file past offset 0x7ffff000 (just under 2GB ever appended) fail and return 0.
+    int trim(int off);
+    int head(); // First offset still in the file
+    // Copy len bytes (everything to EOF if negative) from the read position to dst and return how many it took, -1 if
+    // no write buffer was free.  Double buffered out of the write buffer pool, splitting one if only one is free.
+    int sendTo(FastROMFSSink &dst, int len = -1);
+
+  public: // SPIFFS compatibility stuff
+    int position() { return tell(); };
+
+  public:
+    // Stream stuff
+    // Single bytes are served straight from the handle's read line or the shared sector buffer when
+    // possible, only dropping into the general machinery at line or sector boundaries
+    inline size_t write(uint8_t c) override;
+    size_t write(const char *buffer, size_t size) {
+        return write((const uint8_t *) buffer, size);
+    }
+//    size_t write(const uint8_t *buf, size_t size) override {
+//      return (size_t) write((const void *)buf, (size_t)size);
+//    };
+    int available() override {
+        return size() - tell();
+    };
+    int read() override {
+      int c = -1;
+      if (ReadLineHit() || FillReadLine()) {
+        c = reinterpret_cast<uint8_t*>(readLine)[readPos - readLinePos];
+        readPos++;
+        if (!modeAppend) writePos = readPos;
+      }
+#if FASTROMFS_TRACE
+      Trace(FASTROMFS_TRACE_READ, FASTROMFS_TRACE_BYTECALL, 1, c);
+#endif
+      return c;
+    };
+    int peek() override {
+      int c = -1;
+      if (ReadLineHit() || FillReadLine()) c = reinterpret_cast<uint8_t*>(readLine)[readPos - readLinePos];
+#if FASTROMFS_TRACE
+      Trace(FASTROMFS_TRACE_PEEK, 0, 0, c);
+#endif
+      return c;
+    };
+    void flush() override {
+      sync();
+    };
+    size_t readBytes(char *buffer, size_t length) override {
+        return (size_t)read((void*)buffer, (int) length);
+    };
+
+
+  private:
+    // Like matter, mere mortals can neither create nor destroy this..only the FastROMFilesystem has that power
+    FastROMFile(FastROMFilesystem *fs, int fileIdx, int readOffset, int writeOffset, bool read, bool write, bool append, bool eraseFirstSector);
+    virtual ~FastROMFile();
+    bool FlushData();
+    bool LoadData(int sector, int prevSector);
+    void NewData(int sector, int prevSector);
+    void UpdateData(int offset, const uint8_t *src, int len);
+    bool FillReadLine();
+    size_t WriteV(const FastROMFSIOVec *iov, int iovcnt);
+    int ReadV(const FastROMFSIOVec *iov, int iovcnt);
+    int ReadChain(int32_t *pos, const FastROMFSIOVec *iov, int iovcnt);
+    int ZReadV(const FastROMFSIOVec *iov, int iovcnt);
+    bool ZLoadBlock(int blk);
+    int SendFill(uint8_t *buf, int bufSize, int left);
+    int DataLen();
+#if FASTROMFS_TRACE
+    void Trace(uint8_t op, int arg, int32_t a, int32_t b);
+#endif
+    bool ReadLineValid() {
+      return ((uint32_t)(readPos - readLinePos) < (uint32_t)readLineLen) && (readLineGen == shared->dataGen);
+    }
+#if FASTROMFS_THREADSAFE
+    bool ReadLineHit(); // Another task could be writing, so check under the lock
+#else
+    bool ReadLineHit() {
+      return ReadLineValid();
+    }
+#endif
+    
+    FastROMFilesystem *fs; // Where do I live?
+    int fileIdx; // Which entry
+    FastROMFileShared *shared; // Write buffer and sector map shared with other handles on this file
+
+    int32_t writePos; // = offset from 0 in file
+    int32_t readPos; // = offset from 0 in file
+    int32_t curReadSector;
+    int32_t curReadSectorOffset;
+    uint32_t readChainGen; // = shared->chainGen when curReadSector was found
+    uint32_t readLine[8]; // = small aligned cache for byte-at-a-time Stream reads
+    int32_t readLinePos; // = file offset of readLine[0]
+    int readLineLen; // = valid bytes in readLine
+    uint32_t readLineGen; // = shared->dataGen when readLine was filled
+
+    bool modeAppend; // = flag
+    bool modeRead; // = flag
+    bool modeWrite; // = flag
+    bool compressed; // = read-only compressed file, positions count decompressed bytes
+    int32_t rawLen; // = decompressed length when compressed
+};
 
 class FastROMFilesystem
 {
     friend class FastROMFile;
+    friend class FastROMFSOpTimer;
+    friend class FastROMKV;
   public:
     FastROMFilesystem(int sectors = 0);
     ~FastROMFilesystem();
@@ -82,151 +453,415 @@ class FastROMFilesystem
     bool unlink(const char *name);
     bool exists(const char *name);
     bool rename(const char *src, const char *dest);
+    bool truncate(const char *name, int len);
+    int trim(const char *name, int off);
+    // Make dest a copy of src sharing all of its sectors, for one metadata flush however big src is.  The two only
+    // drift apart where they're written, but a FAT of next-links can't share a chain's start without its end, so the
+    // first write to sector N of either copies sectors 0..N-1 of that file as well.  Fails if dest exists.
+    bool clone(const char *src, const char *dest);
     int available();
     int fsize(const char *name);
-    FastROMFSDir *opendir(const char *ignored) {
-      (void)ignored;
-      return opendir();
+    // Only lists names starting with prefix, so "logs/" works like a subdirectory.  NULL, "" and "/" list everything.
+    FastROMFSDir *opendir(const char *prefix);
+    FastROMFSDir *opendir() {
+      return opendir(NULL);
     };
-    FastROMFSDir *opendir();
     struct FastROMFSDirent *readdir(FastROMFSDir *dir);
     int closedir(FastROMFSDir *dir);
 
+    bool idle(int maxErases = 1); // Returns true if there's more background work to do
+    // Move at most maxMoves sectors towards every file being contiguous, packed in directory order after the metadata.
+    // Sectors of open files stay put.  Returns true if there's more to do.  Safe against power loss at any point.
+    bool defrag(int maxMoves = 4);
+    int fragments(); // Breaks in file chains where the next sector isn't the following one, 0 = fully contiguous
+    void setRandomSeed(uint32_t seed); // Allocation order only depends on this and the calls made, per instance
+    // Limit the flash time of one write()/sync()/close()/open() to about maxUs or maxFlashOps erases and programs (0 = no limit).
+    // With a yield hook the call runs to completion, yielding whenever the budget is used up.  Without one, write() returns
+    // a short count at the first sector boundary past the budget, so a call overshoots by at most one sector flush.
+    void setWriteBudget(uint32_t maxUs, int maxFlashOps);
+    void setYieldHook(FastROMFSYieldHook hook, void *arg);
+#if FASTROMFS_TRACE
+    void setTraceHook(FastROMFSTraceHook hook, void *arg); // Called from whichever task made the call
+#endif
+    void getStats(FastROMFSStats *st);
+    void resetStats();
+#if FASTROMFS_INSTRUMENT
+    bool getLatency(int op, FastROMFSLatency *lat); // op = FASTROMFS_OP_xxx
+    void resetLatency();
+    void setFlashOpHook(FastROMFSFlashOpHook hook, void *arg);
+#endif
+
     void DumpFS();
     void DumpSector(int sector);
 
+#if FASTROMFS_WRITEBEHIND
+    void setWriteBehind(bool enable);
+    bool pump(); // Program one queued sector, returns true if more are waiting
+#endif
+
 #ifndef ARDUINO
   public:
     void DumpToFile(FILE *f);
     void LoadFromFile(FILE *f);
+    // Make the simulated flash take (roughly) as long as real hardware, in microseconds
+    void SetSimulatedLatency(int readUsPerKB, int writeUs, int eraseUs);
+    uint32_t SimulatedEraseCount(int sector); // Lifetime erases of one simulated sector, for wear reports
+    // Store a read-only file compressed in 4KB blocks, which read() and seek() decode transparently.  Written plain
+    // when that comes out smaller.  Opening it with "w" replaces it with a normal file, r+/a/a+ are refused.
+    bool writeCompressed(const char *name, const void *data, int len);
+    // Image building: store name in the first run of free sectors that holds it whole, optionally compressed, and leave
+    // the metadata for umount() to write once.  Added in access order they end up contiguous and in that order.
+    bool writeContiguous(const char *name, const void *data, int len, bool compress = false);
 #endif
 
   protected:
+#if FASTROMFS_UNPACKEDFAT
+    int GetFAT(int idx) {
+      if ((uint32_t)idx >= (uint32_t)fs.md.sectors) return -1;
+      return fat16[idx];
+    }
+    void SetFAT(int idx, int val) {
+      if ((uint32_t)idx >= (uint32_t)fs.md.sectors) return;
+      fat16[idx] = val;
+      fsIsDirty = true;
+    }
+    void PackFAT();
+    void UnpackFAT();
+#else
     int GetFAT(int idx);
     void SetFAT(int idx, int val);
+#endif
+    int GetPackedFAT(int idx);
+    void SetPackedFAT(int idx, int val);
     bool EraseSector(int sector);
     bool WriteSector(int sector, const void *data);
     bool ReadSector(int sector, void *data);
+    bool ReadFlashWords(int sector, int offset, uint32_t *dest, int words);
     bool ReadPartialSector(int sector, int offset, void *dest, int len);
+    bool ProgramSector(int sector, const void *data);
+    bool ProgramPartialSector(int sector, int offset, const void *data, int len);
+    bool DrainWriteBehind();
+    bool IsQueued(int sector);
+    void WaitUnqueued(int sector);
+#ifndef ARDUINO
+    void SimRead(int sector, int offset, void *dest, int len);
+    uint8_t *SimProgram(int sector);
+    void SimErase(int sector);
+#endif
+#if FASTROMFS_WRITEBEHIND
+    void ProgramQueueHead();
+    bool InQueue(int sector);
+    bool ReadQueued(int sector, int offset, void *dest, int len);
+#ifndef ARDUINO
+    static void *WriteBehindThread(void *arg);
+#endif
+#endif
+    uint32_t Random() { // xorshift32, private to this instance so parallel filesystems don't interact
+      rngState ^= rngState << 13;
+      rngState ^= rngState >> 17;
+      rngState ^= rngState << 5;
+      return rngState;
+    }
     int FindFreeSector();
+    bool IsSectorBlank(int sector);
+    int PreErasePoolDepth();
+#if FASTROMFS_WRITEBEHIND && !defined(ARDUINO)
+    // The write-behind thread erases and programs too, so neighbouring bits can change under us
+    bool IsErased(int sector) {
+      return __atomic_load_n(&erasedMap[sector >> 3], __ATOMIC_RELAXED) & (1 << (sector & 7));
+    }
+    void SetErased(int sector, bool erased) {
+      if (erased) __atomic_fetch_or(&erasedMap[sector >> 3], 1 << (sector & 7), __ATOMIC_RELAXED);
+      else __atomic_fetch_and(&erasedMap[sector >> 3], ~(1 << (sector & 7)), __ATOMIC_RELAXED);
+    }
+#else
+    bool IsErased(int sector) {
+      return erasedMap[sector >> 3] & (1 << (sector & 7));
+    }
+    void SetErased(int sector, bool erased) {
+      if (erased) erasedMap[sector >> 3] |= 1 << (sector & 7);
+      else erasedMap[sector >> 3] &= ~(1 << (sector & 7));
+    }
+#endif
+    FileEntryInRAM &Entry(int idx) { // The metadata sector's entries, then the directory chain's
+#if FASTROMFS_MAX_FILES > FILEENTRIES
+      if (idx >= FILEENTRIES) return dirEntry[idx - FILEENTRIES];
+#endif
+      return fs.md.fileEntry[idx];
+    }
+    void EntryChanged(int idx) {
+      fsIsDirty = true;
+#if FASTROMFS_MAX_FILES > FILEENTRIES
+      if (idx >= FILEENTRIES) dirDirty |= 1UL << ((idx - FILEENTRIES) / DIRENTRIES);
+#endif
+    }
+    bool FileEntryInUse(int idx) {
+#if FASTROMFS_LOWRAM
+      return nameHash[idx] != 0;
+#else
+      return Entry(idx).name[0] != 0;
+#endif
+    }
     int FindFreeFileEntry();
     int FindFileEntryByName(const char *name);
     int CreateNewFileEntry(const char *name);
     void GetFileEntryName(int idx, char *dest);
     int GetFileEntryLen(int idx);
     int GetFileEntryFAT(int idx);
+    int GetFileEntryHead(int idx);
+    bool GetFileEntryCompressed(int idx);
+    int GetFileEntryDataLen(int idx); // What reads see, the decompressed length for compressed files
     void SetFileEntryName(int idx, const char *src);
     void SetFileEntryLen(int idx, int len);
     void SetFileEntryFAT(int idx, int fat);
+    bool RemoveFileEntry(const char *name);
+    bool TruncateFileEntry(int idx, int len);
+    int TrimFileEntry(int idx, int off);
+    bool MoveSector(int src, int dst, int fileIdx, int prev, void *buff);
+    bool FindLink(int sector, int *fileIdx, int *prev);
+    bool CopySector(int src, int dst);
+    bool FindSharedSectors(uint8_t *shared);
+    int SectorRefs(int sector);
+    void ReleaseChain(int sector, int stop = -1);
+    int UnshareChain(int idx, int n);
+#if FASTROMFS_MAX_FILES > FILEENTRIES
+    bool LoadDirChain();
+    bool WriteDirChain();
+    static uint32_t NameIndexHash(const char *name);
+    void NameIndexAdd(int idx);
+    void NameIndexRemove(int idx);
+    void NameIndexRebuild();
+#endif
+    FastROMFileShared *FindShared(int fileIdx);
+    FastROMFileShared *AcquireShared(int fileIdx, bool write);
+    void ReleaseShared(FastROMFileShared *sh);
+    void OrphanShared(int fileIdx);
+    FastROMFile *OpenFile(const char *name, const char *mode);
+#if FASTROMFS_TRACE
+    void Trace(uint8_t op, const FastROMFile *f, int arg, int32_t a, int32_t b);
+    static int32_t TraceNameHash(const char *name);
+#endif
+    static uint32_t Micros();
+    void StartBudget() {
+      budgetStart = Micros();
+      budgetOps = 0;
+    }
+    bool BudgetSpent();
+    void YieldPoint();
+#if FASTROMFS_INSTRUMENT
+    void RecordLatency(int op, int sector, uint32_t us);
+#endif
+    FastROMFile *OpenHandle(int fileIdx, int readOffset, int writeOffset, bool read, bool write, bool append, bool eraseFirstSector);
+    void CloseHandle(FastROMFile *f);
+    int PoolAlloc(uint32_t *used, int count);
+    void PoolFree(uint32_t *used, int idx) {
+      *used &= ~(1UL << idx);
+    }
+    bool PoolFull(uint32_t used, int count) {
+      return used == (uint32_t)((1ULL << count) - 1);
+    }
     bool FlushFAT();
+#if FASTROMFS_LOWRAM
+    bool ValidateFATSector(int sector, int64_t *epoch);
+    bool LoadFATSector(int sector);
+    bool WriteFATSector(int sector);
+    uint8_t NameHash(const char *name);
+#else
     bool ValidateFAT();
+#endif
     void CRC32(const void *data, size_t n_bytes, uint32_t* crc);
 
 
   private:
+#if FASTROMFS_LOWRAM
+    FilesystemInRAM fs;
+    uint8_t nameHash[FILEENTRIES]; // 0 = unused entry, otherwise a hash of the name to skip most flash reads on lookup
+    struct {
+      int idx; // -1 = free
+      char name[NAMELEN];
+    } pendingName[FASTROMFS_LOWRAM_NAMES]; // Names changed since the newest metadata sector was written
+#else
     FilesystemInFlash fs;
+#endif
+#if FASTROMFS_MAX_FILES > FILEENTRIES
+    FileEntry dirEntry[DIRSECTORS * DIRENTRIES]; // Entries FILEENTRIES and up, one chain sector's worth at a time
+    uint32_t dirDirty; // Bit N set = chain sector N needs rewriting on the next flush
+    int dirChainLen; // Sectors in the chain on flash
+    uint16_t nameIndex[2 * FASTROMFS_MAX_FILES]; // Open addressing on NameIndexHash(), entry + 1, 0 = empty
+#endif
     bool fsIsMounted;
     bool fsIsDirty;
+    bool clones; // = some sector may be in more than one file's chain, checked for on mount and cleared once none are
     uint32_t totalSectors;
+#if FASTROMFS_UNPACKEDFAT
+    uint16_t fat16[MAXFATENTRIES]; // Working copy of fs.md.fat, which is only brought up to date on flush
+#endif
     uint8_t fatSector[FATCOPIES]; // Sorted list with [0] == newest, [FATENTRIES-1] = oldest FAT sector
+    FastROMFileShared *openFiles; // Per-file state for everything currently open
+    uint8_t erasedMap[MAXFATENTRIES / 8]; // Sectors known to be erased and not yet programmed
+    FastROMFSStats stats;
+    uint32_t rngState;
+    uint32_t budgetMaxUs; // setWriteBudget() limits, 0 = none
+    int budgetMaxOps;
+    uint32_t budgetStart; // Micros() at the start of the current call or since the last yield
+    int budgetOps; // Flash erases/programs since then
+    FastROMFSYieldHook yieldHook;
+    void *yieldArg;
+#if FASTROMFS_TRACE
+    FastROMFSTraceHook traceHook;
+    void *traceArg;
+#endif
+#if FASTROMFS_INSTRUMENT
+    FastROMFSLatency latency[FASTROMFS_OPS]; // p50Us/p99Us unused here, only computed on the way out
+    FastROMFSFlashOpHook flashOpHook;
+    void *flashOpArg;
+#endif
+    // Fixed pools, bit N of each *Used mask set means slot N is handed out
+    uint64_t handlePool[FASTROMFS_MAX_OPEN_FILES][(sizeof(FastROMFile) + 7) / 8]; // Raw storage, handles are placement-new'd in
+    uint32_t handleUsed;
+    FastROMFileShared sharedPool[FASTROMFS_MAX_OPEN_FILES]; // Never more open files than handles
+    uint32_t sharedUsed;
+    uint32_t bufferPool[FASTROMFS_MAX_WRITE_BUFFERS][SECTORSIZE / 4];
+    uint32_t bufferUsed;
+    struct FastROMFSDirent direntPool[FASTROMFS_MAX_OPEN_DIRS];
+    char direntPrefix[FASTROMFS_MAX_OPEN_DIRS][NAMELEN + 1]; // opendir() filter for each iterator
+    uint32_t direntUsed;
+#if FASTROMFS_WRITEBEHIND
+    bool writeBehind;
+    int wbSector[FASTROMFS_WRITEBEHIND_DEPTH];
+    uint32_t wbData[FASTROMFS_WRITEBEHIND_DEPTH][SECTORSIZE / 4]; // uint32_t to keep flash writes aligned
+    int wbHead; // Oldest queued entry
+    int wbCount;
+    bool wbBusy; // Head entry is being programmed, don't touch it
+    bool wbError; // Sticky until the next drain reports it
+#ifndef ARDUINO
+    bool wbStop;
+    pthread_t wbThread;
+    pthread_mutex_t wbMutex;
+    pthread_cond_t wbCond;
+#endif
+#endif
+#if FASTROMFS_THREADSAFE
+    pthread_rwlock_t fsLock; // Shared for lookups and reads, exclusive for anything that changes state
+#endif
 #ifdef ARDUINO
     // As-defined at compile-time, but the FS metadata may say something different...
     uint32_t baseAddr;
     uint32_t baseSector;
     
-    // Cache the last misaligned read data just incase we have some kind of sequential 1-byte scanning going on
+    // Cache the last single-word read just incase we have some kind of sequential 1-byte scanning going on
     // Very special-case, but it occurs in many applications
     int lastFlashSector;
     int lastFlashSectorOffset;
     uint32_t lastFlashSectorData;
 
 #else
-    uint8_t flash[MAXFATENTRIES][SECTORSIZE];
-    bool flashErased[MAXFATENTRIES];
+    uint8_t **flash; // Simulated flash, one buffer per sector, NULL = erased (all 0xff) until first programmed
+    uint32_t *simEraseCount;
+    int simReadUsPerKB;
+    int simWriteUs;
+    int simEraseUs;
 #endif
 };
 
 
-#ifdef ARDUINO
-class FastROMFile : public Stream
-#else
-#define override
-class FastROMFile
-#endif
-{
-    friend class FastROMFilesystem;
-
-  public:
-    size_t write(const uint8_t *out, size_t size) override;
-    int read(void *data, int size);
-    bool seek(int off, int whence);
-    bool seek(int off) {
-      return seek(off, SEEK_SET);
-    }
-    int close();
-    int tell();
-    int eof();
-    int size();
-    void name(char *buff, int buffLen);
-    int fputc(int c);
-    int fgetc();
-    int sync();
-
-  public: // SPIFFS compatibility stuff
-    int position() { return tell(); };
+// Key-value records packed into one file's sectors.  Each put()/remove() appends a record straight to flash (one program,
+// plus a metadata flush whenever a new sector is started), get() finds the record through a RAM hash index and reads
+// it in one go.  The index is rebuilt by scanning the records in begin().  compact() copies the live records out of the
+// oldest sector and trims it off the head of the file, call it from idle time.
+// Keys are at most 32 bytes, a whole record (8 byte header + key + value) at most 256.
+#define FASTROMKV_MAXKEY 32
+#define FASTROMKV_MAXRECORD 256
 
+class FastROMKV
+{
   public:
-    // Stream stuff
-    size_t write(uint8_t c) override {
-      return write(&c, 1);
-    };
-    size_t write(const char *buffer, size_t size) {
-        return write((const uint8_t *) buffer, size);
-    }
-//    size_t write(const uint8_t *buf, size_t size) override {
-//      return (size_t) write((const void *)buf, (size_t)size);
-//    };
-    int available() override {
-        return size() - tell();
-    };
-    int read() override {
-      return fgetc();
-    };
-    int peek() override {
-      int pos = tell();
-      int c = fgetc();
-      seek(pos);
-      return c;
-    };
-    void flush() override {
-      sync();
-    };
-    size_t readBytes(char *buffer, size_t length) override {
-        return (size_t)read((void*)buffer, (int) length);
-    };
-
+    FastROMKV();
+    ~FastROMKV();
+    bool begin(FastROMFilesystem *fs, const char *name = "kv.log"); // Mounted filesystem, creates the file if needed
+    void end(); // Before umount()
+    int get(const char *key, void *value, int maxLen); // Returns the value's length, -1 if missing or maxLen < 0
+    bool put(const char *key, const void *value, int len);
+    bool remove(const char *key);
+    int count();
+    bool compact(int maxSectors = 1); // Returns true if there's more garbage worth reclaiming
 
   private:
-    // Like matter, mere mortals can neither create nor destroy this..only the FastROMFilesystem has that power
-    FastROMFile(FastROMFilesystem *fs, int fileIdx, int readOffset, int writeOffset, bool read, bool write, bool append, bool eraseFirstSector);
-    virtual ~FastROMFile();
-    
-    FastROMFilesystem *fs; // Where do I live?
-    int fileIdx; // Which entry
+    typedef struct {
+      uint8_t keyLen; // 0xff = erased, end of this sector's records
+      uint8_t flags; // FASTROMKV_PUT or FASTROMKV_DELETE
+      uint16_t valLen;
+      uint32_t crc; // Over the header with crc = 0, then key and value
+    } Header;
+    typedef struct {
+      uint32_t hash; // 0 = empty slot
+      uint16_t sector;
+      uint16_t where; // Offset / 4 in the low 10 bits, record size / 4 - 1 above
+    } Slot;
+
+    static uint32_t Hash(const char *key, int keyLen);
+    int Find(const char *key, int keyLen, uint32_t hash);
+    void Insert(uint32_t hash, int sector, int offset, int size);
+    void Erase(int slot);
+    int SlotOffset(int slot) {
+      return (index[slot].where & 0x3ff) * 4;
+    }
+    int SlotSize(int slot) {
+      return ((index[slot].where >> 10) + 1) * 4;
+    }
+    void Point(int slot, int sector, int offset, int size) {
+      index[slot].sector = sector;
+      index[slot].where = (offset / 4) | ((size / 4 - 1) << 10);
+    }
+    int Garbage() { // Bytes in dead records, not counting the tail's free space
+      return sectors * SECTORSIZE - liveBytes - (SECTORSIZE - tailOff);
+    }
+    bool Scan();
+    bool CompactOne();
+    bool Append(const char *key, int keyLen, uint32_t hash, uint8_t flags, const void *value, int len);
+    bool NewSector();
+
+    FastROMFilesystem *fs;
+    FastROMFile *pin; // Read handle that keeps defrag() off our sectors
+    int fileIdx;
+    int tailSector;
+    int tailOff; // Next free byte in tailSector, SECTORSIZE once it's full or holds a torn record
+    int sectors; // In the chain
+    int liveBytes; // Bytes in records the index still points to
+    int keys;
+    Slot index[FASTROMKV_INDEX_SIZE];
+};
 
-    int32_t writePos; // = offset from 0 in file
-    int32_t readPos; // = offset from 0 in file
-    int32_t curWriteSector; // = current sector in buffer
-    int32_t curWriteSectorOffset; // = offset of byte[0] of the current sector in the file
-    int32_t curReadSector;
-    int32_t curReadSectorOffset;
-    uint8_t *data; // = sector data.  On update, read old sector into it.
-    bool dataDirty; // = flag the data here is dirty
 
-    bool modeAppend; // = flag
-    bool modeRead; // = flag
-    bool modeWrite; // = flag
-};
+// Inlined here since it needs the filesystem's accessors
+inline size_t FastROMFile::write(uint8_t c)
+{
+#if !FASTROMFS_THREADSAFE
+  if (modeWrite && (shared->fileIdx == fileIdx) && ((uint32_t)(writePos - shared->curWriteSectorOffset) < SECTORSIZE)) {
+    int off = writePos - shared->curWriteSectorOffset;
+    uint8_t *d = &shared->data[off];
+    if (shared->cowPending && shared->clearOnly && (c & ~*d)) shared->clearOnly = false;
+    *d = c;
+    if (off < shared->dirtyLo) shared->dirtyLo = off;
+    if (off >= shared->dirtyHi) shared->dirtyHi = off + 1;
+    shared->dataDirty = true;
+    shared->dataGen++;
+    writePos++;
+    if (!modeAppend) readPos = writePos;
+    if (writePos > fs->GetFileEntryLen(fileIdx)) fs->SetFileEntryLen(fileIdx, writePos);
+#if FASTROMFS_TRACE
+    Trace(FASTROMFS_TRACE_WRITE, FASTROMFS_TRACE_BYTECALL, 1, 1);
+#endif
+    return 1;
+  }
+#endif
+  FastROMFSIOVec iov = { &c, 1 };
+  size_t ret = WriteV(&iov, 1);
+#if FASTROMFS_TRACE
+  Trace(FASTROMFS_TRACE_WRITE, FASTROMFS_TRACE_BYTECALL, 1, ret);
+#endif
+  return ret;
+}
 
 #ifndef ARDUINO
 #undef override
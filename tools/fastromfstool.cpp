@@ -9,13 +9,108 @@
 void usage()
 {
 	printf("Usage:  fastromfstool [command] [options] ...\n");
-	printf("        fastromfstool mkfs --image fastromfs.bin --sectors count --dir dir-to-upload\n");
+	printf("        fastromfstool mkfs --image fastromfs.bin --sectors count --dir dir-to-upload [--compress]\n");
 	printf("        fastromfstool ls --image fastromfs.bin\n");
 	printf("        fastromfstool cpto --file sourcefile.bin --image fastromfs.bin\n");
 	printf("        fastromfstool cpfrom --file sourcefile.bin --image fastromfs.bin\n");
+	printf("        fastromfstool defrag --image fastromfs.bin\n");
+	printf("        fastromfstool build --image fastromfs.bin --sectors count --dir dir-to-upload [--order access-list.txt] [--compress]\n");
+	printf("        fastromfstool batch --image fastromfs.bin --script commands.txt\n");
+	printf("Build lays every file out in contiguous sectors, the ones in the access list first and in that order.\n");
+	printf("Batch scripts have one command per line, applied with a single load and save of the image:\n");
+	printf("        add local-file [name]\n");
+	printf("        extract name [local-file]\n");
+	printf("        delete name\n");
 	exit(-1);
 }
 
+// Whole 4KB blocks each way, so every write() fills a sector buffer in one go
+bool CopyIn(FastROMFilesystem *fs, const char *local, const char *name)
+{
+	FILE *fi = fopen(local, "rb");
+	if (!fi) {
+		printf("ERROR:  Unable to open file '%s' for reading\n", local);
+		return false;
+	}
+	FastROMFile *fo = fs->open(name, "wb");
+	if (!fo) {
+		printf("ERROR:  Can't create file '%s' in filesystem\n", name);
+		fclose(fi);
+		return false;
+	}
+	uint8_t buff[4096];
+	size_t len;
+	bool ok = true;
+	while (ok && (len = fread(buff, 1, sizeof(buff), fi)) > 0) {
+		if (fo->write(buff, len) != len) {
+			printf("ERROR:  Out of space\n");
+			ok = false;
+		}
+	}
+	fclose(fi);
+	fo->close();
+	return ok;
+}
+
+bool CopyOut(FastROMFilesystem *fs, const char *name, const char *local)
+{
+	FastROMFile *fi = fs->open(name, "rb");
+	if (!fi) {
+		printf("ERROR:  Can't open file '%s' in filesystem for reading\n", name);
+		return false;
+	}
+	FILE *fo = fopen(local, "wb");
+	if (!fo) {
+		printf("ERROR:  Can't open file '%s' for writing\n", local);
+		fi->close();
+		return false;
+	}
+	uint8_t buff[4096];
+	int len;
+	bool ok = true;
+	while (ok && (len = fi->read(buff, sizeof(buff))) > 0) {
+		if (fwrite(buff, 1, len, fo) != (size_t)len) ok = false;
+	}
+	fclose(fo);
+	fi->close();
+	return ok;
+}
+
+// The whole file in memory, for writeCompressed()/writeContiguous().  Caller frees.
+char *Slurp(const char *local, int *len)
+{
+	FILE *fi = fopen(local, "rb");
+	if (!fi) return NULL;
+	fseek(fi, 0, SEEK_END);
+	*len = ftell(fi);
+	fseek(fi, 0, SEEK_SET);
+	char *data = (char *)malloc(*len + 1);
+	if (data && (fread(data, 1, *len, fi) != (size_t)*len)) {
+		free(data);
+		data = NULL;
+	}
+	fclose(fi);
+	return data;
+}
+
+bool SaveUnmount(FastROMFilesystem *fs, const char *image)
+{
+	fs->umount();
+	FILE *f = fopen(image, "wb");
+	if (!f) {
+		printf("ERROR:  Unable to open image file '%s' for writing\n", image);
+		return false;
+	}
+	fs->DumpToFile(f);
+	fclose(f);
+	return true;
+}
+
+static int CompareNames(const void *a, const void *b)
+{
+	return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
 FastROMFilesystem *LoadMount(const char *image)
 {
 	FastROMFilesystem *fs = new FastROMFilesystem();
@@ -30,13 +125,33 @@ FastROMFilesystem *LoadMount(const char *image)
 	return fs;
 }
 
+bool AddContiguous(FastROMFilesystem *fs, const char *dir, const char *name, bool compress)
+{
+	char path[512];
+	snprintf(path, sizeof(path), "%s/%s", dir, name);
+	printf("Adding %s...\n", path);
+	int len;
+	char *data = Slurp(path, &len);
+	if (!data) {
+		printf("ERROR:  Unable to read '%s'\n", path);
+		return false;
+	}
+	bool ok = fs->writeContiguous(name, data, len, compress);
+	free(data);
+	if (!ok) printf("ERROR:  Can't add '%s', out of space or directory entries?\n", name);
+	return ok;
+}
+
 int main(int argc, char **argv)
 {
 	const char *image = "fastromfs.bin";
 	const char *dir = "data";
 	const char *file = "file.txt";
+	const char *order = NULL;
+	const char *script = NULL;
 	int sectors = MAXFATENTRIES;
-	enum {MKFS, LS, CPTO, CPFROM} command;
+	bool compress = false;
+	enum {MKFS, LS, CPTO, CPFROM, DEFRAG, BUILD, BATCH} command;
 
 	if (argc < 2) usage();
 
@@ -44,13 +159,21 @@ int main(int argc, char **argv)
 	else if (!strcmp(argv[1], "ls")) command = LS;
 	else if (!strcmp(argv[1], "cpto")) command = CPTO;
 	else if (!strcmp(argv[1], "cpfrom")) command = CPFROM;
+	else if (!strcmp(argv[1], "defrag")) command = DEFRAG;
+	else if (!strcmp(argv[1], "build")) command = BUILD;
+	else if (!strcmp(argv[1], "batch")) command = BATCH;
 	else usage();
 
 	for (int i=2; i<argc; i++) {
-		if (!strcmp(argv[i], "--image")) { image = argv[++i]; }
+		bool hasArg = i + 1 < argc;
+		if (!strcmp(argv[i], "--compress")) { compress = true; }
+		else if (!hasArg) { printf("ERROR:  Missing argument to '%s'\n", argv[i]); usage(); }
+		else if (!strcmp(argv[i], "--image")) { image = argv[++i]; }
 		else if (!strcmp(argv[i], "--dir")) { dir = argv[++i]; }
 		else if (!strcmp(argv[i], "--sectors")) { sectors = atol(argv[++i]); }
-		else if (!strcmp(argv[i], "--file")) { file = argv[++i]; i++; }
+		else if (!strcmp(argv[i], "--file")) { file = argv[++i]; }
+		else if (!strcmp(argv[i], "--order")) { order = argv[++i]; }
+		else if (!strcmp(argv[i], "--script")) { script = argv[++i]; }
 		else { printf("ERROR:  Unknown option '%s'\n", argv[i]); usage(); }
 	}
 
@@ -62,36 +185,31 @@ int main(int argc, char **argv)
 		fs->mount();
 
 		DIR *d = opendir(dir);
+		if (!d) {
+			printf("ERROR:  Unable to open directory '%s'\n", dir);
+			return -1;
+		}
 		struct dirent *de;
 		while (NULL != (de = readdir(d))) {
 			if (de->d_name[0] == '.') continue;
-			char buff[128];
-			sprintf(buff, "%s/%s", dir, de->d_name);
+			char buff[512];
+			snprintf(buff, sizeof(buff), "%s/%s", dir, de->d_name);
 			printf("Adding %s...\n", buff);
-			FILE *fi = fopen(buff, "rb");
-			FastROMFile *fo = fs->open(de->d_name, "wb");
-			if (!fo) {
-				printf("ERROR:  Can't create file '%s' in filesystem\n", de->d_name);
-				return -1;
-			}
-			int ch;
-			while (EOF !=  (ch = fgetc(fi))) {
-				if (fo->fputc(ch) < 0) {
-					printf("ERROR:  Out of space\n");
+			if (compress) {
+				// Read-only web assets shrink by half or more, and the ESP8266 decodes them on the fly
+				int len;
+				char *data = Slurp(buff, &len);
+				if (!data || !fs->writeCompressed(de->d_name, data, len)) {
+					printf("ERROR:  Can't add compressed file '%s', out of space?\n", de->d_name);
 					return -1;
 				}
+				free(data);
+				continue;
 			}
-			fclose(fi);
-			fo->close();
-		}
-		fs->umount();
-		FILE *fo = fopen(image, "wb");
-		if (!fo) {
-			printf("ERROR:  Unable to open image file '%s' for writing\n", image);
-			return -1;
+			if (!CopyIn(fs, buff, de->d_name)) return -1;
 		}
-		fs->DumpToFile(fo);
-		return 0;
+		closedir(d);
+		return SaveUnmount(fs, image) ? 0 : -1;
 	}
 	case LS:
 	{
@@ -114,52 +232,114 @@ int main(int argc, char **argv)
 	case CPTO:
 	{
 		FastROMFilesystem *fs = LoadMount(image);
-
-		FILE *fi = fopen(file, "rb");
-		if (!fi) {
-			printf("ERROR:  Unable to open file '%s' for reading\n", file);
-			return -1;
-		}
-		FastROMFile *fo = fs->open(file, "wb");
-		int ch;
-		while (EOF !=  (ch = fgetc(fi))) fo->fputc(ch);
-		fclose(fi);
-		fo->close();
-		fs->umount();
-
-		FILE *f = fopen(image, "wb");
-		fs->DumpToFile(f);
-		fclose(f);
-		return 0;
+		if (!CopyIn(fs, file, file)) return -1;
+		return SaveUnmount(fs, image) ? 0 : -1;
 	}
 	case CPFROM:
 	{
 		FastROMFilesystem *fs = LoadMount(image);
+		return CopyOut(fs, file, file) ? 0 : -1; // Read only, the image stays as it was
+	}
+	case DEFRAG:
+	{
+		FastROMFilesystem *fs = LoadMount(image);
+
+		int before = fs->fragments();
+		while (fs->defrag(64)) { /* keep going */ }
+		FastROMFSStats st;
+		fs->getStats(&st);
+		printf("Fragments: %d before, %d after, %u sectors moved\n", before, fs->fragments(), st.defragMoves);
+		return SaveUnmount(fs, image) ? 0 : -1;
+	}
+
+	case BUILD:
+	{
+		FastROMFilesystem *fs = new FastROMFilesystem(sectors);
+		fs->mkfs();
+		fs->mount();
 
-		FastROMFile *fo = fs->open(file, "rb");
-		if (!fo) {
-			printf("ERROR:  Can't open file '%s' in filesystem for reading\n", file);
+		DIR *d = opendir(dir);
+		if (!d) {
+			printf("ERROR:  Unable to open directory '%s'\n", dir);
 			return -1;
 		}
-		FILE *fi = fopen(file, "wb");
-		if (!fi) {
-			printf("ERROR:  Can't open file '%s' in for writing\n", file);
-			return -1;
+		char **names = NULL;
+		int count = 0;
+		struct dirent *de;
+		while (NULL != (de = readdir(d))) {
+			if (de->d_name[0] == '.') continue;
+			names = (char **)realloc(names, (count + 1) * sizeof(char *));
+			names[count++] = strdup(de->d_name);
 		}
-		int ch;
-		while (EOF !=  (ch = fo->fgetc())) fputc(ch, fi);
-		fclose(fi);
-		fo->close();
-		fs->umount();
+		closedir(d);
+		qsort(names, count, sizeof(char *), CompareNames);
 
-		FILE *f = fopen(image, "wb");
-		if (!fo) {
-			printf("ERROR:  Unable to open image file '%s' for writing\n", image);
+		// Whatever's read first at boot goes first, so it sits together at the front of the image
+		int added = 0;
+		if (order) {
+			FILE *fo = fopen(order, "r");
+			if (!fo) {
+				printf("ERROR:  Unable to open access list '%s'\n", order);
+				return -1;
+			}
+			char line[512];
+			while (fgets(line, sizeof(line), fo)) {
+				line[strcspn(line, "\r\n")] = 0;
+				if (!line[0] || (line[0] == '#')) continue;
+				int i;
+				for (i = 0; (i < count) && (!names[i] || strcmp(names[i], line)); i++) { /* find it */ }
+				if (i == count) {
+					printf("WARNING:  '%s' from the access list isn't in '%s' (or is listed twice)\n", line, dir);
+					continue;
+				}
+				if (!AddContiguous(fs, dir, names[i], compress)) return -1;
+				free(names[i]);
+				names[i] = NULL;
+				added++;
+			}
+			fclose(fo);
+		}
+		for (int i = 0; i < count; i++) {
+			if (!names[i]) continue;
+			if (!AddContiguous(fs, dir, names[i], compress)) return -1;
+			free(names[i]);
+			added++;
+		}
+		free(names);
+		printf("%d files, %d fragments, %d bytes free\n", added, fs->fragments(), fs->available());
+		return SaveUnmount(fs, image) ? 0 : -1;
+	}
+	case BATCH:
+	{
+		FILE *sf = (!script || !strcmp(script, "-")) ? stdin : fopen(script, "r");
+		if (!sf) {
+			printf("ERROR:  Unable to open script '%s'\n", script);
 			return -1;
 		}
-		fs->DumpToFile(f);
-		fclose(f);
-		return 0;
+		FastROMFilesystem *fs = LoadMount(image);
+		char line[1024];
+		int lineNo = 0, done = 0;
+		while (fgets(line, sizeof(line), sf)) {
+			lineNo++;
+			char *cmd = strtok(line, " \t\r\n");
+			if (!cmd || (cmd[0] == '#')) continue;
+			char *a = strtok(NULL, " \t\r\n");
+			char *b = strtok(NULL, " \t\r\n");
+			bool ok = a != NULL;
+			if (ok && !strcmp(cmd, "add")) ok = CopyIn(fs, a, b ? b : a);
+			else if (ok && !strcmp(cmd, "extract")) ok = CopyOut(fs, a, b ? b : a);
+			else if (ok && !strcmp(cmd, "delete")) ok = fs->unlink(a);
+			else ok = false;
+			if (!ok) {
+				// Nothing's been saved yet, so the image on disk is untouched
+				printf("ERROR:  Line %d failed: %s %s %s\n", lineNo, cmd, a ? a : "", b ? b : "");
+				return -1;
+			}
+			done++;
+		}
+		if (sf != stdin) fclose(sf);
+		printf("%d commands applied\n", done);
+		return SaveUnmount(fs, image) ? 0 : -1;
 	}
 
 	default:
@@ -0,0 +1,732 @@
+// Host-side benchmarks for ESP8266FastROMFS
+// Usage:  fsbench [benchmark ...]  (runs everything when none given)
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <ESP8266FastROMFS.h>
+
+static double Now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1.0e9;
+}
+
+static FastROMFilesystem *NewFS()
+{
+	FastROMFilesystem *fs = new FastROMFilesystem();
+	fs->mkfs();
+	fs->mount();
+	return fs;
+}
+
+static void MakeFile(FastROMFilesystem *fs, const char *name, int kb)
+{
+	uint8_t buff[1024];
+	for (int i=0; i<1024; i++) buff[i] = (uint8_t)i;
+	FastROMFile *f = fs->open(name, "w");
+	for (int i=0; i<kb; i++) f->write(buff, sizeof(buff));
+	f->close();
+}
+
+
+// Concurrent random readers, with and without an external big lock around each call
+#define THREADREADS 2000
+#define THREADFILEKB 256
+
+#if FASTROMFS_THREADSAFE
+struct ThreadArgs {
+	FastROMFilesystem *fs;
+	pthread_mutex_t *bigLock;
+	unsigned int seed;
+};
+
+static void *ReaderThread(void *p)
+{
+	ThreadArgs *a = (ThreadArgs *)p;
+	FastROMFile *f = a->fs->open("threads.bin", "r");
+	uint8_t buff[256];
+	for (int i=0; i<THREADREADS; i++) {
+		int off = rand_r(&a->seed) % (THREADFILEKB * 1024 - sizeof(buff));
+		if (a->bigLock) pthread_mutex_lock(a->bigLock);
+		f->seek(off);
+		f->read(buff, sizeof(buff));
+		if (a->bigLock) pthread_mutex_unlock(a->bigLock);
+	}
+	f->close();
+	return NULL;
+}
+#endif
+
+static void BenchThreads()
+{
+#if !FASTROMFS_THREADSAFE
+	printf("threads: library built without FASTROMFS_THREADSAFE, skipping\n");
+#else
+	FastROMFilesystem *fs = NewFS();
+	MakeFile(fs, "threads.bin", THREADFILEKB);
+	fs->SetSimulatedLatency(50, 0, 0); // Model SPI read time so overlapped waits show up
+
+	pthread_mutex_t bigLock;
+	pthread_mutex_init(&bigLock, NULL);
+	printf("threads: %d random 256b reads per thread\n", THREADREADS);
+	printf("%8s %14s %14s\n", "threads", "biglock ops/s", "rwlock ops/s");
+	for (int n = 1; n <= 8; n *= 2) {
+		double rate[2];
+		for (int mode = 0; mode < 2; mode++) {
+			pthread_t tid[8];
+			ThreadArgs args[8];
+			double start = Now();
+			for (int i=0; i<n; i++) {
+				args[i].fs = fs;
+				args[i].bigLock = mode ? NULL : &bigLock;
+				args[i].seed = i + 1;
+				pthread_create(&tid[i], NULL, ReaderThread, &args[i]);
+			}
+			for (int i=0; i<n; i++) pthread_join(tid[i], NULL);
+			rate[mode] = (n * THREADREADS) / (Now() - start);
+		}
+		printf("%8d %14.0f %14.0f\n", n, rate[0], rate[1]);
+	}
+	pthread_mutex_destroy(&bigLock);
+	fs->umount();
+	delete fs;
+#endif
+}
+
+
+// Caller-visible write() latency while the app does other work between writes
+#define WBSECTORS 24
+#define WBCHUNK 256
+#define WBLOOPUS 3000
+
+static void BenchWriteBehind()
+{
+#if !FASTROMFS_WRITEBEHIND
+	printf("writebehind: library built without FASTROMFS_WRITEBEHIND, skipping\n");
+#else
+	uint8_t buff[WBCHUNK];
+	memset(buff, 0xa5, sizeof(buff));
+	printf("writebehind: %dKB in %db writes, %dus of app work between writes, 20ms erase/5ms program\n", WBSECTORS * 4, WBCHUNK, WBLOOPUS);
+	printf("%12s %10s %10s %10s %10s\n", "mode", "avg us", "max us", "close us", "total ms");
+	for (int mode = 0; mode < 2; mode++) {
+		FastROMFilesystem *fs = NewFS();
+		fs->SetSimulatedLatency(0, 5000, 20000);
+		fs->setWriteBehind(mode == 1);
+		FastROMFile *f = fs->open("wb.bin", "w");
+		double start = Now();
+		double worst = 0, sum = 0;
+		int n = WBSECTORS * SECTORSIZE / WBCHUNK;
+		for (int i=0; i<n; i++) {
+			double t = Now();
+			f->write(buff, sizeof(buff));
+			t = Now() - t;
+			sum += t;
+			if (t > worst) worst = t;
+			usleep(WBLOOPUS);
+		}
+		double c = Now();
+		f->close();
+		fs->umount(); // Barrier, everything's on flash after this
+		c = Now() - c;
+		double total = Now() - start;
+		printf("%12s %10.0f %10.0f %10.0f %10.0f\n", mode ? "write-behind" : "direct", 1e6 * sum / n, 1e6 * worst, 1e6 * c, 1e3 * total);
+		delete fs;
+	}
+#endif
+}
+
+
+// Sequential 256b reads with the file offset and RAM buffer aligned vs. misaligned
+#define ALIGNFILEKB 512
+
+static void BenchReadAlign()
+{
+	FastROMFilesystem *fs = NewFS();
+	MakeFile(fs, "align.bin", ALIGNFILEKB);
+	uint32_t buff[65];
+	printf("readalign: %dKB sequential reads in 256b chunks\n", ALIGNFILEKB);
+	printf("%12s %10s\n", "mode", "MB/s");
+	for (int mode = 0; mode < 2; mode++) {
+		double start = Now();
+		for (int rep = 0; rep < 20; rep++) {
+			FastROMFile *f = fs->open("align.bin", "r");
+			if (mode) f->read(); // Knock the file position off alignment
+			uint8_t *dest = reinterpret_cast<uint8_t*>(buff) + mode;
+			while (f->read(dest, 256) == 256) { /* read it all */ }
+			f->close();
+		}
+		double t = Now() - start;
+		printf("%12s %10.1f\n", mode ? "misaligned" : "aligned", 20.0 * ALIGNFILEKB / 1024.0 / t);
+	}
+	fs->umount();
+	delete fs;
+}
+
+
+// Single byte Stream-style reads and writes vs. the general 1-byte read()/write() path
+#define BYTECOUNT (256 * 1024)
+
+static void BenchBytes()
+{
+	FastROMFilesystem *fs = NewFS();
+	printf("bytes: %dKB one byte at a time\n", BYTECOUNT / 1024);
+	printf("%12s %12s %12s\n", "mode", "write MB/s", "read MB/s");
+	for (int mode = 0; mode < 2; mode++) {
+		double start = Now();
+		FastROMFile *f = fs->open("bytes.bin", "w");
+		for (int i = 0; i < BYTECOUNT; i++) {
+			uint8_t c = (uint8_t)i;
+			if (mode) f->write(c);
+			else f->write(&c, 1);
+		}
+		f->close();
+		double w = Now() - start;
+		start = Now();
+		f = fs->open("bytes.bin", "r");
+		for (int i = 0; i < BYTECOUNT; i++) {
+			uint8_t c;
+			if (mode) f->read();
+			else f->read(&c, 1);
+		}
+		f->close();
+		double r = Now() - start;
+		printf("%12s %12.1f %12.1f\n", mode ? "stream" : "buffer", BYTECOUNT / 1048576.0 / w, BYTECOUNT / 1048576.0 / r);
+	}
+	fs->umount();
+	delete fs;
+}
+
+
+// Header + payload + trailer records as three write()/read() calls vs. one writev()/readv()
+#define IOVRECORDS 20000
+#define IOVPAYLOAD 48
+
+static void BenchIOVec()
+{
+	FastROMFilesystem *fs = NewFS();
+	printf("iovec: %d records of 4b header + %db payload + 2b trailer\n", IOVRECORDS, IOVPAYLOAD);
+	printf("%12s %12s %12s\n", "mode", "write rec/s", "read rec/s");
+	for (int mode = 0; mode < 2; mode++) {
+		uint32_t hdr;
+		uint8_t payload[IOVPAYLOAD];
+		uint16_t trailer;
+		FastROMFSIOVec iov[3] = { { &hdr, sizeof(hdr) }, { payload, sizeof(payload) }, { &trailer, sizeof(trailer) } };
+		memset(payload, 0x5a, sizeof(payload));
+		double start = Now();
+		FastROMFile *f = fs->open("iovec.bin", "w");
+		for (int i = 0; i < IOVRECORDS; i++) {
+			hdr = i;
+			trailer = (uint16_t)~i;
+			if (mode) {
+				f->writev(iov, 3);
+			} else {
+				f->write((const uint8_t *)&hdr, sizeof(hdr));
+				f->write(payload, sizeof(payload));
+				f->write((const uint8_t *)&trailer, sizeof(trailer));
+			}
+		}
+		f->close();
+		double w = Now() - start;
+		start = Now();
+		f = fs->open("iovec.bin", "r");
+		for (int i = 0; i < IOVRECORDS; i++) {
+			if (mode) {
+				f->readv(iov, 3);
+			} else {
+				f->read(&hdr, sizeof(hdr));
+				f->read(payload, sizeof(payload));
+				f->read(&trailer, sizeof(trailer));
+			}
+		}
+		f->close();
+		double r = Now() - start;
+		printf("%12s %12.0f %12.0f\n", mode ? "vectored" : "3 calls", IOVRECORDS / w, IOVRECORDS / r);
+	}
+	fs->umount();
+	delete fs;
+}
+
+
+// Random 1-byte reads from a long file, each one re-walking the FAT chain from the start
+#define CHAINSECTORS 600
+#define CHAINREADS 20000
+
+static void BenchChainWalk()
+{
+	FastROMFilesystem *fs = NewFS();
+	MakeFile(fs, "chain.bin", CHAINSECTORS * SECTORSIZE / 1024);
+	FastROMFile *f = fs->open("chain.bin", "r");
+	unsigned int seed = 1;
+	long steps = 0;
+	double start = Now();
+	for (int i = 0; i < CHAINREADS; i++) {
+		int sector = rand_r(&seed) % CHAINSECTORS;
+		f->seek(sector * SECTORSIZE + 1);
+		f->read();
+		f->seek(0); // Back to the start so the next read walks from scratch
+		f->read();
+		steps += sector;
+	}
+	double t = Now() - start;
+	f->close();
+	printf("chainwalk: %s FAT, %d random reads in a %d sector file\n", FASTROMFS_UNPACKEDFAT ? "unpacked 16-bit" : "packed 12-bit", CHAINREADS, CHAINSECTORS);
+	printf("%12s %12s\n", "reads/s", "ns/step");
+	printf("%12.0f %12.2f\n", CHAINREADS / t, 1e9 * t / steps);
+	fs->umount();
+	delete fs;
+}
+
+
+// Fresh filesystem instances, as randomized tests create them
+#define INSTANCES 500
+
+static void BenchInstances()
+{
+	double start = Now();
+	for (int i = 0; i < INSTANCES; i++) {
+		FastROMFilesystem *fs = NewFS();
+		MakeFile(fs, "small.bin", 8);
+		fs->umount();
+		delete fs;
+	}
+	double t = Now() - start;
+	printf("instances: new + mkfs + mount + 8KB file + umount + delete\n");
+	printf("%12s\n", "per second");
+	printf("%12.0f\n", INSTANCES / t);
+}
+
+
+// Independent filesystems on parallel threads, each sweeping its own seeds.  Two passes must agree exactly.
+#define SEEDS 256
+#define SEEDTHREADS 4
+
+struct SeedArgs {
+	int first;
+	uint32_t sum[SEEDS];
+};
+
+static uint32_t SeedLayout(uint32_t seed)
+{
+	FastROMFilesystem *fs = new FastROMFilesystem(64);
+	fs->setRandomSeed(seed);
+	fs->mkfs();
+	fs->mount();
+	for (int i = 0; i < 8; i++) {
+		char nm[16];
+		sprintf(nm, "f%d", i);
+		MakeFile(fs, nm, 4 + 3 * i);
+		if (i & 1) fs->unlink("f0");
+	}
+	fs->umount();
+	char *img = NULL;
+	size_t len = 0;
+	FILE *f = open_memstream(&img, &len);
+	fs->DumpToFile(f);
+	fclose(f);
+	uint32_t h = 2166136261UL;
+	for (size_t i = 0; i < len; i++) h = (h ^ (uint8_t)img[i]) * 16777619UL;
+	free(img);
+	delete fs;
+	return h;
+}
+
+static void *SeedThread(void *p)
+{
+	SeedArgs *a = (SeedArgs *)p;
+	for (int s = a->first; s < SEEDS; s += SEEDTHREADS) a->sum[s] = SeedLayout(s + 1);
+	return NULL;
+}
+
+static void BenchSeeds()
+{
+	static SeedArgs args[2][SEEDTHREADS];
+	printf("seeds: %d seeded 64-sector filesystems on %d threads, run twice\n", SEEDS, SEEDTHREADS);
+	printf("%12s %12s\n", "fs/s", "reruns");
+	double start = Now();
+	for (int pass = 0; pass < 2; pass++) {
+		pthread_t tid[SEEDTHREADS];
+		for (int i = 0; i < SEEDTHREADS; i++) {
+			args[pass][i].first = i;
+			pthread_create(&tid[i], NULL, SeedThread, &args[pass][i]);
+		}
+		for (int i = 0; i < SEEDTHREADS; i++) pthread_join(tid[i], NULL);
+	}
+	double t = Now() - start;
+	bool same = true;
+	for (int s = 0; s < SEEDS; s++) {
+		if (args[0][s % SEEDTHREADS].sum[s] != args[1][s % SEEDTHREADS].sum[s]) same = false;
+	}
+	printf("%12.0f %12s\n", 2 * SEEDS / t, same ? "identical" : "MISMATCH");
+}
+
+
+// Tail latency per operation type under a mixed workload on slow simulated flash
+#define LATFILEKB 64
+
+#if FASTROMFS_INSTRUMENT
+static void CountSlowFlashOp(int op, int sector, uint32_t us, void *arg)
+{
+	(void)op;
+	(void)sector;
+	if (us >= 10000) (*(int *)arg)++;
+}
+#endif
+
+static void BenchLatency()
+{
+#if !FASTROMFS_INSTRUMENT
+	printf("latency: library built without FASTROMFS_INSTRUMENT, skipping\n");
+#else
+	static const char *names[FASTROMFS_OPS] = { "erase", "program", "flashread", "flushfat", "open", "close", "read", "write", "seek", "sync" };
+	FastROMFilesystem *fs = NewFS();
+	fs->SetSimulatedLatency(100, 5000, 20000);
+	int slow = 0;
+	fs->setFlashOpHook(CountSlowFlashOp, &slow);
+	fs->resetLatency();
+	uint8_t buff[512];
+	memset(buff, 0x3c, sizeof(buff));
+	FastROMFile *f = fs->open("lat.bin", "w+");
+	for (int i=0; i<LATFILEKB * 1024 / 256; i++) {
+		f->write(buff, 256);
+		if (i % 32 == 31) f->sync();
+	}
+	srand(1);
+	for (int i=0; i<200; i++) {
+		f->seek(rand() % (LATFILEKB * 1024 - sizeof(buff)), SEEK_SET);
+		if (i & 1) f->write(buff, 1 + rand() % sizeof(buff));
+		else f->read(buff, 1 + rand() % sizeof(buff));
+	}
+	f->close();
+	fs->umount();
+	printf("latency: %dKB file, 256b appends + random 1-512b r/w, 100us/KB read, 5ms program, 20ms erase\n", LATFILEKB);
+	printf("%10s %8s %10s %10s %10s %10s\n", "op", "count", "avg us", "p50 us", "p99 us", "max us");
+	for (int op=0; op<FASTROMFS_OPS; op++) {
+		FastROMFSLatency l;
+		fs->getLatency(op, &l);
+		if (!l.count) continue;
+		printf("%10s %8u %10.0f %10u %10u %10u\n", names[op], l.count, (double)l.totalUs / l.count, l.p50Us, l.p99Us, l.maxUs);
+	}
+	printf("flash ops over 10ms seen by the hook: %d\n", slow);
+	delete fs;
+#endif
+}
+
+
+// Longest single stretch inside the filesystem for one big write(), with and without a budget
+#define BUDGETKB 64
+#define BUDGETUS 50000
+
+static double lastYield, worstGap;
+
+static void TimeYield(void *arg)
+{
+	(void)arg;
+	double t = Now();
+	if (t - lastYield > worstGap) worstGap = t - lastYield;
+	lastYield = t;
+}
+
+static void BenchBudget()
+{
+	static uint8_t buff[BUDGETKB * 1024];
+	memset(buff, 0x77, sizeof(buff));
+	printf("budget: one %dKB write(), 20ms erase/5ms program, %dms budget\n", BUDGETKB, BUDGETUS / 1000);
+	printf("%12s %10s %14s %10s\n", "mode", "calls", "longest ms", "total ms");
+	for (int mode = 0; mode < 3; mode++) {
+		FastROMFilesystem *fs = NewFS();
+		fs->SetSimulatedLatency(0, 5000, 20000);
+		if (mode) fs->setWriteBudget(BUDGETUS, 0);
+		if (mode == 2) fs->setYieldHook(TimeYield, NULL);
+		FastROMFile *f = fs->open("budget.bin", "w");
+		size_t done = 0;
+		int calls = 0;
+		double start = Now();
+		worstGap = 0;
+		while (done < sizeof(buff)) {
+			double t = Now();
+			lastYield = t;
+			size_t n = f->write(buff + done, sizeof(buff) - done);
+			t = Now();
+			if (t - lastYield > worstGap) worstGap = t - lastYield;
+			if (!n) break;
+			done += n;
+			calls++;
+		}
+		double total = Now() - start;
+		f->close();
+		static const char *names[] = { "unbounded", "short count", "yield hook" };
+		printf("%12s %10d %14.1f %10.0f\n", names[mode], calls, 1e3 * worstGap, 1e3 * total);
+		delete fs;
+	}
+}
+
+#define KVKEYS 50 // Leave room in the directory for one file per key
+#define KVOPS 2000
+
+// Small settings records: one file per key against FastROMKV, flash traffic per operation
+static void BenchKV()
+{
+	printf("kv: %d keys, %d updates then %d lookups, flash bytes per op\n", KVKEYS, KVOPS, KVOPS);
+	printf("%12s %10s %10s %10s %10s\n", "store", "put prog", "put erases", "get read", "get us");
+	for (int mode = 0; mode < 2; mode++) {
+		FastROMFilesystem *fs = NewFS();
+		FastROMKV kv;
+		if (mode) kv.begin(fs, "bench.kv");
+		char key[16], val[32];
+		srand(1);
+		FastROMFSStats put, get;
+		fs->resetStats();
+		for (int i = 0; i < KVOPS; i++) {
+			sprintf(key, "k%d", rand() % KVKEYS);
+			int len = sprintf(val, "setting %d", i);
+			if (mode) {
+				kv.put(key, val, len);
+				kv.compact();
+			} else {
+				FastROMFile *f = fs->open(key, "w");
+				f->write(val, len);
+				f->close();
+			}
+		}
+		fs->getStats(&put);
+		fs->resetStats();
+		double start = Now();
+		for (int i = 0; i < KVOPS; i++) {
+			sprintf(key, "k%d", rand() % KVKEYS);
+			if (mode) {
+				kv.get(key, val, sizeof(val));
+			} else {
+				FastROMFile *f = fs->open(key, "r");
+				if (f) {
+					f->read(val, sizeof(val));
+					f->close();
+				}
+			}
+		}
+		double t = Now() - start;
+		fs->getStats(&get);
+		printf("%12s %10.1f %10.3f %10.1f %10.2f\n", mode ? "FastROMKV" : "file/key", (double)put.bytesProgrammed / KVOPS,
+		       (double)put.sectorErases / KVOPS, (double)get.bytesRead / KVOPS, 1e6 * t / KVOPS);
+		kv.end();
+		delete fs;
+	}
+}
+
+#define DIRLOOKUPS 200000
+
+// Name lookups as the directory fills up, linear below 64 entries and through the name index past that
+static void BenchDir()
+{
+	FastROMFilesystem *fs = NewFS();
+	int files = FASTROMFS_MAX_FILES < 512 ? FASTROMFS_MAX_FILES : 512;
+	printf("dir: fsize() of a random existing name, FASTROMFS_MAX_FILES=%d\n", FASTROMFS_MAX_FILES);
+	printf("%10s %14s\n", "files", "ns/lookup");
+	char nm[32];
+	int made = 0;
+	for (int step = 16; step <= files; step *= 2) {
+		for (; made < step; made++) {
+			sprintf(nm, "dir/%04d", made);
+			FastROMFile *f = fs->open(nm, "w");
+			if (!f) break;
+			f->close();
+		}
+		srand(1);
+		double start = Now();
+		int found = 0;
+		for (int i = 0; i < DIRLOOKUPS; i++) {
+			sprintf(nm, "dir/%04d", rand() % made);
+			if (fs->fsize(nm) == 0) found++;
+		}
+		double t = Now() - start;
+		printf("%10d %14.1f%s\n", made, 1e9 * t / DIRLOOKUPS, (found == DIRLOOKUPS) ? "" : " (lookups failed!)");
+	}
+	delete fs;
+}
+
+
+#define ZPAGEKB 64
+
+// Serving a web page stored plain and through writeCompressed(), with SPI read time modelled
+static void BenchCompress()
+{
+	static char page[ZPAGEKB * 1024];
+	int plen = 0;
+	for (int i = 0; plen < (int)sizeof(page) - 80; i++)
+		plen += sprintf(page + plen, "<tr><td class=\"n\">%d</td><td>sensor %d</td><td>%d.%d</td></tr>\n", i, i % 17, (i * 37) % 100, i % 10);
+	printf("compress: %dKB generated table page, whole-file and random 512b reads, 100us/KB flash read\n", ZPAGEKB);
+	printf("%12s %10s %14s %10s %14s %10s\n", "mode", "on flash", "whole KB read", "whole ms", "rand KB read", "rand ms");
+	for (int mode = 0; mode < 2; mode++) {
+		FastROMFilesystem *fs = NewFS();
+		int freeBefore = fs->available();
+		if (mode) fs->writeCompressed("page.html", page, plen);
+		else {
+			FastROMFile *f = fs->open("page.html", "w");
+			f->write(page, plen);
+			f->close();
+		}
+		int onFlash = freeBefore - fs->available();
+		fs->SetSimulatedLatency(100, 0, 0);
+		char buff[512];
+		FastROMFSStats whole, rnd;
+		fs->resetStats();
+		double start = Now();
+		FastROMFile *f = fs->open("page.html", "r");
+		while (f->read(buff, sizeof(buff)) > 0) { /* stream it out */ }
+		f->close();
+		double tw = Now() - start;
+		fs->getStats(&whole);
+		fs->resetStats();
+		srand(1);
+		start = Now();
+		f = fs->open("page.html", "r");
+		for (int i = 0; i < 100; i++) {
+			f->seek(rand() % (plen - sizeof(buff)), SEEK_SET);
+			f->read(buff, sizeof(buff));
+		}
+		f->close();
+		double tr = Now() - start;
+		fs->getStats(&rnd);
+		delete fs;
+		printf("%12s %10d %14.1f %10.1f %14.1f %10.1f\n", mode ? "compressed" : "plain", onFlash, whole.bytesRead / 1024.0, 1e3 * tw, rnd.bytesRead / 1024.0, 1e3 * tr);
+	}
+}
+
+
+#define SENDKB 256
+
+// A socket that drains its 2 x 1460 byte window at a fixed rate, write() sleeps until what it's given fits
+class TimedSink : public FastROMFSSink
+{
+  public:
+    TimedSink(int usPerKB) : usPerKB(usPerKB), idleAt(0) {}
+    int Queued() {
+      double left = idleAt - Now();
+      return (left <= 0) ? 0 : (int)(left * 1e6 * 1024 / usPerKB);
+    }
+    int availableForWrite() override {
+      return 2920 - Queued();
+    }
+    size_t write(const uint8_t *buf, size_t size) override {
+      (void)buf;
+      double now = Now();
+      idleAt = ((idleAt > now) ? idleAt : now) + size * usPerKB / 1024.0 / 1e6;
+      int over = Queued() - 2920; // Returns once the last byte is inside the window
+      if (over > 0) usleep((over * usPerKB) / 1024);
+      return size;
+    }
+    int usPerKB;
+    double idleAt;
+};
+
+// Serving a file to a socket, the usual read()/write() loop against sendTo() overlapping flash reads with the drain
+static void BenchSendTo()
+{
+	printf("sendto: %dKB file to a 2920 byte window socket, 100us/KB flash read\n", SENDKB);
+	printf("%12s %12s %12s %12s\n", "link us/KB", "loop ms", "sendTo ms", "read-aheads");
+	static const int links[] = { 1000, 400, 100 };
+	for (size_t l = 0; l < sizeof(links) / sizeof(links[0]); l++) {
+		FastROMFilesystem *fs = NewFS();
+		MakeFile(fs, "page.bin", SENDKB);
+		fs->SetSimulatedLatency(100, 0, 0);
+		double t[2];
+		FastROMFSStats st;
+		for (int mode = 0; mode < 2; mode++) {
+			TimedSink sink(links[l]);
+			fs->resetStats();
+			double start = Now();
+			FastROMFile *f = fs->open("page.bin", "r");
+			if (mode) {
+				f->sendTo(sink);
+			} else {
+				uint8_t buff[1460];
+				int n;
+				while ((n = f->read(buff, sizeof(buff))) > 0) sink.write(buff, n);
+			}
+			f->close();
+			while (sink.Queued()) { /* let the last segment go out */ }
+			t[mode] = Now() - start;
+			fs->getStats(&st);
+		}
+		printf("%12d %12.1f %12.1f %12u\n", links[l], 1e3 * t[0], 1e3 * t[1], st.sendReadAheads);
+		delete fs;
+	}
+}
+
+
+#define CLONEKB 256
+
+// Backing a file up before changing it, a read()/write() copy against clone(), then one 4KB rewrite in the middle
+static void BenchClone()
+{
+	printf("clone: %dKB file, 40ms erase/12ms program/100us per KB read\n", CLONEKB);
+	printf("%8s %10s %10s %10s %14s\n", "mode", "ms", "erases", "programs", "rewrite erases");
+	for (int mode = 0; mode < 2; mode++) {
+		FastROMFilesystem *fs = NewFS();
+		MakeFile(fs, "big.bin", CLONEKB);
+		fs->SetSimulatedLatency(100, 12000, 40000);
+		FastROMFSStats st, rw;
+		fs->resetStats();
+		double start = Now();
+		if (mode) {
+			fs->clone("big.bin", "big.bak");
+		} else {
+			FastROMFile *in = fs->open("big.bin", "r");
+			FastROMFile *out = fs->open("big.bak", "w");
+			uint8_t buff[4096];
+			int n;
+			while ((n = in->read(buff, sizeof(buff))) > 0) out->write(buff, n);
+			out->close();
+			in->close();
+		}
+		double t = Now() - start;
+		fs->getStats(&st);
+		fs->resetStats();
+		FastROMFile *f = fs->open("big.bin", "r+");
+		f->seek(CLONEKB * 1024 / 2);
+		uint8_t buff[4096];
+		memset(buff, 0x5a, sizeof(buff));
+		f->write(buff, sizeof(buff));
+		f->close();
+		fs->getStats(&rw);
+		printf("%8s %10.1f %10u %10u %14u\n", mode ? "clone" : "copy", 1e3 * t, st.sectorErases, st.sectorWrites, rw.sectorErases);
+		delete fs;
+	}
+}
+
+
+static const struct {
+	const char *name;
+	void (*fn)();
+} benches[] = {
+	{ "threads", BenchThreads },
+	{ "writebehind", BenchWriteBehind },
+	{ "readalign", BenchReadAlign },
+	{ "bytes", BenchBytes },
+	{ "iovec", BenchIOVec },
+	{ "chainwalk", BenchChainWalk },
+	{ "instances", BenchInstances },
+	{ "seeds", BenchSeeds },
+	{ "latency", BenchLatency },
+	{ "budget", BenchBudget },
+	{ "kv", BenchKV },
+	{ "dir", BenchDir },
+	{ "compress", BenchCompress },
+	{ "sendto", BenchSendTo },
+	{ "clone", BenchClone },
+};
+
+int main(int argc, char **argv)
+{
+	for (size_t i=0; i<sizeof(benches)/sizeof(benches[0]); i++) {
+		bool run = (argc < 2);
+		for (int j=1; j<argc; j++) if (!strcmp(argv[j], benches[i].name)) run = true;
+		if (run) benches[i].fn();
+	}
+	return 0;
+}
@@ -0,0 +1,218 @@
+// Replay a FASTROMFS_TRACE capture against the host build and report flash traffic, modeled time and wear
+// Usage:  fsreplay --trace file.trace [--image fastromfs.bin] [--sectors count] [--seed n]
+//                  [--erase-us us] [--program-us us] [--read-us-per-kb us]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <ESP8266FastROMFS.h>
+
+void usage()
+{
+	printf("Usage:  fsreplay --trace file.trace [--image fastromfs.bin] [--sectors count] [--seed n]\n");
+	printf("                 [--erase-us us] [--program-us us] [--read-us-per-kb us]\n");
+	printf("Starts from a fresh mkfs unless an image is given.  Flash costs default to typical SPI NOR:\n");
+	printf("40000us per 4KB erase, 12000us per 4KB program, 100us per KB read.\n");
+	exit(-1);
+}
+
+// Traces only carry name hashes, so every distinct file gets a stable made-up name
+static void TraceName(int32_t hash, char *name)
+{
+	sprintf(name, "t%08x", (unsigned)hash);
+}
+
+static const char *TraceMode(int arg)
+{
+	bool plus = arg & 0x100;
+	switch (arg & 0xff) {
+	case 'r': return plus ? "r+" : "r";
+	case 'w': return plus ? "w+" : "w";
+	case 'a': return plus ? "a+" : "a";
+	default: return "";
+	}
+}
+
+int main(int argc, char **argv)
+{
+	const char *trace = NULL;
+	const char *image = NULL;
+	int sectors = MAXFATENTRIES;
+	uint32_t seed = 1;
+	double eraseUs = 40000, programUs = 12000, readUsPerKB = 100;
+
+	for (int i=1; i<argc; i++) {
+		if (i + 1 >= argc) usage();
+		if (!strcmp(argv[i], "--trace")) { trace = argv[++i]; }
+		else if (!strcmp(argv[i], "--image")) { image = argv[++i]; }
+		else if (!strcmp(argv[i], "--sectors")) { sectors = atol(argv[++i]); }
+		else if (!strcmp(argv[i], "--seed")) { seed = atol(argv[++i]); }
+		else if (!strcmp(argv[i], "--erase-us")) { eraseUs = atof(argv[++i]); }
+		else if (!strcmp(argv[i], "--program-us")) { programUs = atof(argv[++i]); }
+		else if (!strcmp(argv[i], "--read-us-per-kb")) { readUsPerKB = atof(argv[++i]); }
+		else { printf("ERROR:  Unknown option '%s'\n", argv[i]); usage(); }
+	}
+	if (!trace) usage();
+
+	FILE *tf = fopen(trace, "rb");
+	if (!tf) {
+		printf("ERROR:  Unable to open %s\n", trace);
+		exit(-1);
+	}
+
+	FastROMFilesystem *fs = new FastROMFilesystem(sectors);
+	fs->setRandomSeed(seed);
+	if (image) {
+		FILE *f = fopen(image, "rb");
+		if (!f) {
+			printf("ERROR:  Unable to open %s\n", image);
+			exit(-1);
+		}
+		fs->LoadFromFile(f);
+		fclose(f);
+	} else {
+		fs->mkfs();
+	}
+	bool mounted = false;
+
+	FastROMFile *handle[256];
+	memset(handle, 0, sizeof(handle));
+	size_t buffLen = 4096;
+	uint8_t *buff = (uint8_t*)malloc(buffLen);
+	memset(buff, 0x5a, buffLen);
+
+	long count[FASTROMFS_TRACE_OPS];
+	memset(count, 0, sizeof(count));
+	long readBytes = 0, writeBytes = 0, skipped = 0, records = 0;
+	uint32_t firstTime = 0, lastTime = 0;
+	FastROMFSTraceRecord rec;
+	while (fread(&rec, sizeof(rec), 1, tf) == 1) {
+		if (!records++) firstTime = rec.time;
+		lastTime = rec.time;
+		if ((rec.op < FASTROMFS_TRACE_MOUNT) || (rec.op >= FASTROMFS_TRACE_OPS)) {
+			skipped++;
+			continue;
+		}
+		count[rec.op]++;
+		if (!mounted && (rec.op != FASTROMFS_TRACE_MOUNT)) mounted = fs->mount(); // Capture started after mount()
+		FastROMFile *f = handle[rec.handle];
+		bool needHandle = (rec.op >= FASTROMFS_TRACE_CLOSE) && (rec.op <= FASTROMFS_TRACE_SYNC);
+		if (needHandle && !f) {
+			skipped++;
+			continue;
+		}
+		if ((rec.op == FASTROMFS_TRACE_READ || rec.op == FASTROMFS_TRACE_WRITE) && ((size_t)rec.a > buffLen)) {
+			buffLen = rec.a;
+			buff = (uint8_t*)realloc(buff, buffLen);
+			memset(buff, 0x5a, buffLen);
+		}
+		char name[16], name2[16];
+		switch (rec.op) {
+		case FASTROMFS_TRACE_MOUNT:
+			mounted = fs->mount() || mounted;
+			break;
+		case FASTROMFS_TRACE_UMOUNT:
+			fs->umount();
+			mounted = false;
+			break;
+		case FASTROMFS_TRACE_OPEN:
+			TraceName(rec.a, name);
+			f = fs->open(name, TraceMode(rec.arg));
+			if (rec.handle == 0xff) {
+				if (f) f->close(); // Failed on the device, don't let it hold a slot here
+			} else {
+				handle[rec.handle] = f;
+			}
+			break;
+		case FASTROMFS_TRACE_CLOSE:
+			f->close();
+			handle[rec.handle] = NULL;
+			break;
+		case FASTROMFS_TRACE_READ:
+			if (rec.arg == FASTROMFS_TRACE_BYTECALL) f->read();
+			else f->read(buff, rec.a);
+			readBytes += rec.a;
+			break;
+		case FASTROMFS_TRACE_WRITE:
+			if (rec.arg == FASTROMFS_TRACE_BYTECALL) f->write((uint8_t)0x5a);
+			else f->write(buff, rec.a);
+			writeBytes += rec.a;
+			break;
+		case FASTROMFS_TRACE_PEEK:
+			f->peek();
+			break;
+		case FASTROMFS_TRACE_SEEK:
+			f->seek(rec.a, rec.arg);
+			break;
+		case FASTROMFS_TRACE_SYNC:
+			f->sync();
+			break;
+		case FASTROMFS_TRACE_UNLINK:
+			TraceName(rec.a, name);
+			fs->unlink(name);
+			break;
+		case FASTROMFS_TRACE_RENAME:
+			TraceName(rec.a, name);
+			TraceName(rec.b, name2);
+			fs->rename(name, name2);
+			break;
+		case FASTROMFS_TRACE_CLONE:
+			TraceName(rec.a, name);
+			TraceName(rec.b, name2);
+			fs->clone(name, name2);
+			break;
+		case FASTROMFS_TRACE_IDLE:
+			fs->idle(rec.a);
+			break;
+		case FASTROMFS_TRACE_TRUNCATE:
+			if (rec.handle != 0xff) {
+				if (f) f->truncate(rec.a);
+			} else {
+				TraceName(rec.a, name);
+				fs->truncate(name, rec.b);
+			}
+			break;
+		case FASTROMFS_TRACE_TRIM:
+			if (rec.handle != 0xff) {
+				if (f) f->trim(rec.a);
+			} else {
+				TraceName(rec.a, name);
+				fs->trim(name, rec.b);
+			}
+			break;
+		}
+	}
+	fclose(tf);
+	for (int i=0; i<256; i++) if (handle[i]) handle[i]->close();
+	if (mounted) fs->umount();
+
+	FastROMFSStats st;
+	fs->getStats(&st);
+	printf("trace: %ld records over %.3f s, %ld skipped\n", records, (lastTime - firstTime) / 1e6, skipped);
+	printf("calls: open %ld, close %ld, read %ld (%ld bytes), write %ld (%ld bytes), peek %ld, seek %ld, sync %ld\n",
+	       count[FASTROMFS_TRACE_OPEN], count[FASTROMFS_TRACE_CLOSE], count[FASTROMFS_TRACE_READ], readBytes,
+	       count[FASTROMFS_TRACE_WRITE], writeBytes, count[FASTROMFS_TRACE_PEEK], count[FASTROMFS_TRACE_SEEK], count[FASTROMFS_TRACE_SYNC]);
+	printf("       unlink %ld, rename %ld, clone %ld, truncate %ld, trim %ld, idle %ld, mount %ld, umount %ld\n",
+	       count[FASTROMFS_TRACE_UNLINK], count[FASTROMFS_TRACE_RENAME], count[FASTROMFS_TRACE_CLONE], count[FASTROMFS_TRACE_TRUNCATE], count[FASTROMFS_TRACE_TRIM], count[FASTROMFS_TRACE_IDLE],
+	       count[FASTROMFS_TRACE_MOUNT], count[FASTROMFS_TRACE_UMOUNT]);
+	printf("flash: %u erases, %u sector writes, %u bytes programmed, %u bytes read\n", st.sectorErases, st.sectorWrites, st.bytesProgrammed, st.bytesRead);
+	printf("       %u pre-erase hits, %u misses, %u in-place updates\n", st.preEraseHits, st.preEraseMisses, st.inPlaceUpdates);
+	double erase = st.sectorErases * eraseUs / 1000.0;
+	double program = st.bytesProgrammed * programUs / SECTORSIZE / 1000.0;
+	double read = st.bytesRead * readUsPerKB / 1024.0 / 1000.0;
+	printf("modeled flash time: %.1f ms (erase %.1f, program %.1f, read %.1f)\n", erase + program + read, erase, program, read);
+	uint32_t maxErases = 0, worn = 0;
+	uint64_t totalErases = 0;
+	for (int i=0; i<sectors; i++) {
+		uint32_t e = fs->SimulatedEraseCount(i);
+		if (e) worn++;
+		if (e > maxErases) maxErases = e;
+		totalErases += e;
+	}
+	printf("wear: %u of %d sectors erased, max %u erases, mean %.2f over erased sectors\n", worn, sectors, maxErases, worn ? (double)totalErases / worn : 0.0);
+
+	free(buff);
+	delete fs;
+	return 0;
+}